@@ -3,15 +3,30 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /* Constants */
 
 #define WHITESPACE	" \t\n"
+#define MAX_HEADERS	100
+#define HEALTH_URI	"/health"
+#define METRICS_URI	"/metrics"
+#define SSI_EXTENSION	".shtml"
+#define MAX_WORKERS	64
+
+#define LARGE_FILE_SIZE	(1 << 20)	/* Stream sequentially with readahead */
+#define HUGE_FILE_SIZE	(64 << 20)	/* Drop cold pages behind the send cursor */
+#define DROP_BEHIND	(8 << 20)	/* Bytes sent between drop-behind hints */
+#define CACHE_HOT_HITS	3		/* Hits before a file is pinned in memory */
+#define CACHE_MAX_FILE	(1 << 20)	/* Largest file pinned in memory */
+#define CACHE_MAX_TOTAL	(32 << 20)	/* Total bytes pinned in memory */
+#define CGI_MAX_BUFFER	(1 << 20)	/* Largest CGI output buffered for an ETag */
 
 /**
  * Concurrency modes
@@ -19,6 +34,8 @@
 typedef enum {
 	SINGLE,			/**< Single connection */
 	FORKING,		/**< Process per connection */
+	PREFORKED,		/**< Elastic pool of pre-forked processes */
+	DISPATCH,		/**< Front process dispatching to per-class pools */
 	UNKNOWN
 } ServerMode;
 
@@ -28,6 +45,15 @@ extern char *Port;
 extern char *MimeTypesPath;
 extern char *DefaultMimeType;
 extern char *RootPath;
+extern char *IndexFile;
+extern int   KeepAliveTimeout;
+extern int   MaxRequests;
+extern char *CachePolicyPath;
+extern char *MirrorTarget;
+extern int   MirrorPercent;
+extern int   MinWorkers;
+extern int   MaxWorkers;
+extern int   DispatchWorkers[];
 
 /* Logging Macros */
 
@@ -40,49 +66,369 @@ extern char *RootPath;
 #define fatal(M, ...)	fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n",getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)	fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n",getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
-typedef struct header Header;
-struct header {
+typedef struct {
 	char 	*name;			/*< Name of header entry */
 	char 	*value;			/*< Value of header entry */
-	Header 	*next;			/*< NExt header entry */
+} Header;
+
+/**
+ * Cold per-connection state.
+ *
+ * The textual peer address is only needed for logging and the CGI
+ * environment, so it lives in a side allocation rather than inline in the
+ * Request where it would push the hot fields apart.  The allocation is sized
+ * to the resolved strings so a parked connection stays small.
+ */
+typedef struct {
+	uint64_t page;			/*< Hash of the last HTML page served or 0 */
+	unsigned int retransmits;	/*< TCP retransmits already counted */
+	char	*query;			/*< HTTP query string of the current request */
+	char	*port;			/*< Port number of client */
+	char 	host[];			/*< Host name of client */
+} Peer;
+
+/**
+ * Request flags
+ */
+enum {
+	REQUEST_KEEPALIVE	= 1 << 0,	/*< Connection persists after response */
+	REQUEST_PARKED		= 1 << 1,	/*< Idle with stream and parsed state released */
+	REQUEST_HTTP11		= 1 << 2,	/*< Client sent an HTTP/1.1 request line */
+	REQUEST_DELIMITED	= 1 << 3,	/*< Last response carried a Content-Length */
 };
 
+/**
+ * Hot per-connection state.
+ *
+ * Everything the request path touches is packed into the first cache line;
+ * keep new fields small and put rarely used data in Peer instead.
+ */
 typedef struct {
 	int	fd;			/*< Client socket file descriptor */
-	FILE	*file;			/*< Client socket file stream */
+	unsigned short nheaders;	/*< Number of entries in headers */
+	unsigned short flags;		/*< Request flags */
+	FILE	*in;			/*< Client socket input stream (over a dup of fd) */
+	FILE	*file;			/*< Client socket output stream (over a dup of fd) */
 	char	*method;		/*< HTTP method */
 	char	*uri;			/*< HTTP uniform resource identifier */
 	char	*path;			/*< Real path corresponding to URI and RootPath */
-	char	*query;			/*< HTTP query string */
-	char 	host[NI_MAXHOST];	/*< Host name of client */
-	char	port[NI_MAXSERV];	/*< Port number of client */
-
-	Header *headers;		/*< List of name, value Header pairs */
+	Header	*headers;		/*< Array of name, value Header pairs */
+	Peer	*peer;			/*< Cold client address information */
 } Request;
 
 Request * 	accept_request(int sfd);
+Request *	adopt_request(int fd, const char *head, size_t n);
 void		free_request(Request *request);
+void		reset_request(Request *request);
+bool		park_request(Request *request);
+int		resume_request(Request *request);
 int		parse_request(Request *request);
+const char *	request_header(Request *request, const char *name);
 
 /* HTTP Request Handlers */
 
 typedef enum {
 	HTTP_STATUS_OK = 0,			/* 200 OK */
+	HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
 	HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
 	HTTP_STATUS_NOT_FOUND,			/* 404 Not Found */
 	HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+	HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
 } Status;
 
 Status 		handle_request(Request *request);
+Status		handle_error(Request *request, Status status);
+void		write_connection_headers(Request *request, off_t length);
+
+/* Priority Classes */
+
+/**
+ * Request priority classes (highest priority first)
+ */
+typedef enum {
+	PRIORITY_HEALTH = 0,	/**< Health and metrics checks */
+	PRIORITY_STATIC,	/**< Static files */
+	PRIORITY_BROWSE,	/**< Directory listings */
+	PRIORITY_CGI,		/**< CGI scripts */
+	NPRIORITIES
+} Priority;
+
+extern bool	PriorityRenice;
+
+const char *	priority_string(Priority p);
+bool		priority_admit(Request *request, Priority p);
+void		priority_release(Priority p);
+
+/* Request Routing */
+
+typedef Status (*Handler)(Request *request);
+
+Status		route_request(Request *request, Handler *handler, Priority *priority);
+
+/* Metrics */
+
+/**
+ * Worker states
+ */
+typedef enum {
+	WORKER_FREE = 0,	/**< Scoreboard slot unused */
+	WORKER_IDLE,		/**< Waiting for a connection */
+	WORKER_BUSY,		/**< Serving a connection */
+} WorkerState;
+
+/**
+ * Scoreboard slot of a pre-forked worker
+ */
+typedef struct {
+	pid_t		pid;		/*< Process id of worker */
+	volatile int	state;		/*< WorkerState of worker */
+	volatile bool	retire;		/*< Worker should exit once idle */
+	unsigned int	admitted[NPRIORITIES];	/*< Admission capacity held per class */
+	unsigned int	connections;	/*< Client connections the worker has to close */
+} Worker;
+
+#define HISTOGRAM_BUCKETS	12
+
+/**
+ * Cumulative histogram with fixed bucket bounds
+ */
+typedef struct {
+	unsigned long	buckets[HISTOGRAM_BUCKETS];	/*< Observations at or below each bound */
+	unsigned long	count;				/*< All observations */
+	unsigned long	sum;				/*< Sum of observations */
+} Histogram;
+
+/**
+ * Server metrics shared by all worker processes
+ */
+typedef struct {
+	unsigned int	total;			/*< Requests in progress (all classes) */
+	unsigned int	connections;		/*< Client connections open */
+	unsigned int	active[NPRIORITIES];	/*< Requests in progress per class */
+	unsigned long	served[NPRIORITIES];	/*< Requests completed per class */
+	unsigned long	rejected[NPRIORITIES];	/*< Requests rejected per class */
+	unsigned long	mirrored;		/*< Requests queued for mirroring */
+	unsigned long	mirror_dropped;		/*< Requests dropped by full mirror queue */
+	unsigned long	closed_client;		/*< Connections the client closed first */
+	unsigned long	closed_server;		/*< Connections the server closed first */
+	unsigned long	lingered;		/*< Unread bytes drained before closing */
+	unsigned long	cluster_hits;		/*< Documents fetched from their owner */
+	unsigned long	cluster_misses;		/*< Fetches the owner could not answer */
+	unsigned long	prefetched;		/*< Page dependencies warmed up */
+	unsigned long	compressed;		/*< Responses sent compressed */
+	unsigned long	compress_saved;		/*< Bytes saved by compression */
+	unsigned long	compress_cached;	/*< Responses served from a kept variant */
+	unsigned long	retransmits;		/*< TCP segments retransmitted to clients */
+	unsigned long	stalls;			/*< Event loop iterations over StallThreshold */
+	unsigned int	listen_queued;		/*< Listen queue depth sampled by the front */
+	unsigned int	listen_backlog;		/*< Listen queue limit sampled by the front */
+	unsigned long	listen_drops;		/*< Listen queue drops sampled by the front */
+	Histogram	handling;		/*< Request handling time (microseconds) */
+	Histogram	rtt;			/*< Client TCP RTT at response completion (microseconds) */
+	Histogram	rttvar;			/*< Client TCP RTT variance (microseconds) */
+	Histogram	cwnd;			/*< Congestion window (segments) */
+	Histogram	unacked;		/*< Segments still unacknowledged */
+	Worker		workers[MAX_WORKERS];	/*< Scoreboard of pre-forked workers */
+} Metrics;
+
+extern Metrics *Stats;
+extern Worker  *CurrentWorker;
+
+int		metrics_init(void);
+void		metrics_write(FILE *fs);
+Worker *	metrics_worker(void);
+Worker *	metrics_reap(pid_t pid);
+void		metrics_connection(int delta);
+void		metrics_adopt(int delta);
+void		metrics_sample_listen(int sfd);
+void		metrics_request(Request *request, long started, Status status);
+Status		handle_metrics_request(Request *request);
+
+/* Response Bodies */
+
+/**
+ * Body segment types
+ */
+typedef enum {
+	SEGMENT_MEMORY,		/**< Slice of memory */
+	SEGMENT_FILE,		/**< Range of a file */
+	SEGMENT_PIPE,		/**< Everything readable from a pipe */
+} SegmentType;
+
+/**
+ * Body segment flags
+ */
+enum {
+	SEGMENT_CLOSE		= 1 << 0,	/*< Close the file when the body is released */
+	SEGMENT_DROP_BEHIND	= 1 << 1,	/*< Drop file pages from the page cache once sent */
+};
+
+typedef struct Segment Segment;
+
+/**
+ * One segment of a response body chain
+ */
+struct Segment {
+	SegmentType	type;		/*< Kind of segment */
+	unsigned int	flags;		/*< Segment flags */
+	const char	*data;		/*< Bytes of a memory slice */
+	void		*owner;		/*< Allocation freed with the body or NULL */
+	int		fd;		/*< File or pipe descriptor */
+	off_t		offset;		/*< Offset of a file range */
+	off_t		length;		/*< Length in bytes or -1 for a pipe */
+	Segment		*next;		/*< Next segment in chain */
+};
+
+/**
+ * Response body as a chain of segments
+ */
+typedef struct {
+	Segment		*head;		/*< First segment */
+	Segment		*tail;		/*< Last segment */
+	off_t		sent;		/*< Bytes written to the socket so far */
+} Body;
+
+int		body_memory(Body *body, const void *data, size_t n, void *owner);
+int		body_file(Body *body, int fd, off_t offset, off_t length, unsigned int flags);
+int		body_pipe(Body *body, int fd);
+off_t		body_length(const Body *body);
+void		body_free(Body *body);
+int		body_write(Request *request, Body *body);
+
+/* Persistent Connections */
+
+extern bool	ConnectionLinger;
+
+void		serve_connection(Request *request);
+void		close_connection(Request *request);
+
+/* Directory Index */
+
+char *		determine_index_path(const char *dir, const struct stat *sb);
+
+/* File Cache */
+
+typedef struct {
+	char		*path;		/*< Real path of file (NULL if unused) */
+	struct timespec	mtime;		/*< File mtime when entry was validated */
+	off_t		size;		/*< File size when entry was validated */
+	unsigned int	hits;		/*< Number of lookups of this file */
+	char		*data;		/*< Pinned file contents or NULL */
+	unsigned int	popularity;	/*< Decayed lookups of this file by all workers */
+} CacheEntry;
+
+int		cache_init(void);
+CacheEntry *	cache_lookup(const char *path, const struct stat *sb);
+
+/* Cache Clusters */
+
+extern char *ClusterMembers;
+
+int		cluster_init(void);
+bool		cluster_local(const char *path);
+int		cluster_fetch(Request *request, const struct stat *sb, const CacheEntry *entry, Body *body);
+bool		cluster_answer(Request *request, const struct stat *sb, const CacheEntry *entry);
+void		cluster_screen(Request *request);
+
+/* Hot Set Snapshots */
+
+extern char *SnapshotPath;
+
+int		snapshot_init(void);
+void		snapshot_record(const char *path, const struct stat *sb);
+unsigned int	snapshot_hits(const char *path);
+
+/* Warm Caches */
+
+int		warm_init(void);
+const char *	warm_mimetype(const char *ext);
+const char *	warm_file(const char *path, const struct stat *sb);
+const char *	warm_error(Status status, size_t *length);
+
+/* Cache Policy */
+
+int		policy_load(const char *path);
+bool		policy_fingerprinted(const char *uri);
+void		write_cache_headers(FILE *fs, const char *uri, const char *mimetype);
+
+/* CGI Scripts */
+
+extern int SlowThreshold;
+
+int		cgi_init(void);
+pid_t		cgi_spawn(Request *request, int *fd);
+void		cgi_account(Request *request, pid_t pid, long started, off_t bytes);
+void		write_cgi_metrics(FILE *fs);
+
+/* Compression */
+
+int		compress_init(void);
+void		write_encoding_headers(Request *request, Body *body, const char *mimetype, const struct stat *sb);
+
+/* Heavy Hitters */
+
+int		heavy_init(void);
+void		heavy_record(Request *request, Status status);
+void		write_heavy_metrics(FILE *fs);
+
+/* Prefetching */
+
+int		prefetch_init(void);
+void		write_prefetch_headers(Request *request, const char *mimetype);
+
+/* Recent Metrics */
+
+/**
+ * Events counted per second
+ */
+typedef enum {
+	SERIES_CACHE_HIT = 0,	/**< File served from memory */
+	SERIES_CACHE_MISS,	/**< File read from disk */
+	SERIES_CGI_SPAWN,	/**< CGI script started */
+	NSERIESEVENTS,
+} SeriesEvent;
+
+int		series_init(void);
+void		series_request(Status status, long elapsed);
+void		series_in_flight(unsigned int requests);
+void		series_connections(unsigned int open);
+void		series_event(SeriesEvent event);
+void		write_series(FILE *fs, int seconds);
+
+/* Server-Side Includes */
+
+Status		handle_ssi_request(Request *request);
+
+/* Request Mirroring */
+
+int		mirror_init(void);
+void		mirror_request(Request *request);
 
 /* HTTP Server */
 
 int		single_server(int sfd);
 int		forking_server(int sfd);
+int		preforked_server(int sfd);
+int		dispatch_server(int sfd);
 
 /* Socket */
 
+extern int ServerSocket;
+
 int		socket_listen(const char *port);
+int		socket_queue(int sfd, unsigned int *queued, unsigned int *backlog);
+int		socket_drops(int sfd, unsigned long *drops);
+int		socket_send_fd(int sock, int fd, const void *data, size_t n, int flags);
+int		socket_recv_fd(int sock, void *data, size_t *n, int flags);
+
+/* Watchdog */
+
+extern int StallThreshold;
+
+int		watchdog_start(void);
+void		watchdog_busy(void);
+void		watchdog_phase(const char *phase, int fd, const char *head, size_t length);
+void		watchdog_idle(void);
 
 /* Utilites */
 
@@ -95,5 +441,20 @@ const char *	http_status_string(Status status);
 char *		skip_nonwhitespace(char *s);
 char *		skip_whitespace(char *s);
 
+/**
+ * Snapshot of CPU time counters
+ */
+typedef struct {
+	unsigned long long	busy;		/*< Non-idle jiffies */
+	unsigned long long	total;		/*< All jiffies */
+} CpuSample;
+
+double		cpu_utilisation(CpuSample *last);
+
+#define HASH_INIT	0xcbf29ce484222325UL
+
+uint64_t	hash_bytes(const void *data, size_t n, uint64_t hash);
+long		monotonic_ms(void);
+
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
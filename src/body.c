@@ -0,0 +1,335 @@
+/* body.c: Response Body Chains */
+
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SPLICE_CHUNK	(64 << 10)	/* Bytes moved per splice */
+
+/**
+ * Append a segment to a body.
+ *
+ * @param	b	Body.
+ * @param	s	Segment to copy into the chain.
+ * @return	-1 on error and 0 on success.
+ **/
+static int body_append(Body *b, Segment s) {
+	Segment *segment = malloc(sizeof(Segment));
+	if (!segment) {
+		log("Unable to malloc: %s", strerror(errno));
+		return -1;
+	}
+	*segment = s;
+	segment->next = NULL;
+
+	if (b->tail) {
+		b->tail->next = segment;
+	} else {
+		b->head = segment;
+	}
+	b->tail = segment;
+	return 0;
+}
+
+/**
+ * Append a memory slice.
+ *
+ * @param	b	Body.
+ * @param	data	Bytes of slice.
+ * @param	n	Number of bytes.
+ * @param	owner	Allocation to free with the body, or NULL if the bytes are
+ * borrowed (e.g. a cached blob) and outlive the response.
+ * @return	-1 on error and 0 on success (owner is freed either way).
+ **/
+int body_memory(Body *b, const void *data, size_t n, void *owner) {
+	Segment s = {.type = SEGMENT_MEMORY, .data = data, .length = n, .owner = owner};
+	if (body_append(b, s) < 0) {
+		free(owner);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Append a file range.
+ *
+ * @param	b	Body.
+ * @param	fd	File descriptor.
+ * @param	offset	Offset of range.
+ * @param	length	Length of range.
+ * @param	flags	SEGMENT_CLOSE and/or SEGMENT_DROP_BEHIND.
+ * @return	-1 on error and 0 on success (fd is closed either way if
+ * SEGMENT_CLOSE is set).
+ **/
+int body_file(Body *b, int fd, off_t offset, off_t length, unsigned int flags) {
+	Segment s = {.type = SEGMENT_FILE, .fd = fd, .offset = offset, .length = length, .flags = flags};
+	if (body_append(b, s) < 0) {
+		if (flags & SEGMENT_CLOSE) {
+			close(fd);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Append everything readable from a pipe.
+ *
+ * @param	b	Body.
+ * @param	fd	Read end of pipe (not closed by the body).
+ * @return	-1 on error and 0 on success.
+ **/
+int body_pipe(Body *b, int fd) {
+	Segment s = {.type = SEGMENT_PIPE, .fd = fd, .length = -1};
+	return body_append(b, s);
+}
+
+/**
+ * Determine length of a body.
+ *
+ * @param	b	Body.
+ * @return	Total length in bytes or -1 if it contains a pipe.
+ **/
+off_t body_length(const Body *b) {
+	off_t length = 0;
+	for (Segment *s = b->head; s; s = s->next) {
+		if (s->length < 0) {
+			return -1;
+		}
+		length += s->length;
+	}
+	return length;
+}
+
+/**
+ * Release a body and everything it owns.
+ *
+ * @param	b	Body.
+ **/
+void body_free(Body *b) {
+	Segment *s = b->head;
+	while (s) {
+		Segment *next = s->next;
+		free(s->owner);
+		if (s->type == SEGMENT_FILE && (s->flags & SEGMENT_CLOSE)) {
+			close(s->fd);
+		}
+		free(s);
+		s = next;
+	}
+	b->head = NULL;
+	b->tail = NULL;
+}
+
+/**
+ * Write a run of memory segments with writev.
+ *
+ * @param	fd	Socket file descriptor.
+ * @param	s	First memory segment (advanced past the run).
+ * @param	sent	Incremented by the bytes written.
+ * @return	-1 on error and 0 on success.
+ **/
+static int body_write_memory(int fd, Segment **s, off_t *sent) {
+	struct iovec iov[IOV_MAX];
+	int n = 0;
+
+	for (; *s && (*s)->type == SEGMENT_MEMORY && n < IOV_MAX; *s = (*s)->next) {
+		if ((*s)->length) {
+			iov[n++] = (struct iovec){(void *)(*s)->data, (*s)->length};
+		}
+	}
+
+	struct iovec *v = iov;
+	while (n > 0) {
+		ssize_t nwritten = writev(fd, v, n);
+		if (nwritten < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log("Unable to writev: %s", strerror(errno));
+			return -1;
+		}
+		*sent += nwritten;
+
+		/* Skip what was written, including a partial iovec */
+		while (n > 0 && (size_t)nwritten >= v->iov_len) {
+			nwritten -= v->iov_len;
+			v++;
+			n--;
+		}
+		if (n > 0) {
+			v->iov_base = (char *)v->iov_base + nwritten;
+			v->iov_len -= nwritten;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Write a file range with sendfile.
+ *
+ * @param	fd	Socket file descriptor.
+ * @param	s	File segment.
+ * @param	sent	Incremented by the bytes written.
+ * @return	-1 on error and 0 on success.
+ *
+ * Drop-behind ranges are sent DROP_BEHIND bytes at a time, and the pages
+ * already handed to the socket are released from the page cache after each.
+ **/
+static int body_write_file(int fd, Segment *s, off_t *sent) {
+	off_t offset  = s->offset;
+	off_t end     = s->offset + s->length;
+	off_t dropped = s->offset;
+	off_t chunk   = (s->flags & SEGMENT_DROP_BEHIND) ? DROP_BEHIND : end - offset;
+	int   status  = 0;
+
+	while (offset < end) {
+		ssize_t nsent = sendfile(fd, s->fd, &offset, chunk < end - offset ? chunk : end - offset);
+		if (nsent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nsent <= 0) {
+			log("Unable to sendfile: %s", nsent < 0 ? strerror(errno) : "file truncated");
+			status = -1;
+			break;
+		}
+		*sent += nsent;
+		if ((s->flags & SEGMENT_DROP_BEHIND) && offset - dropped >= DROP_BEHIND) {
+			posix_fadvise(s->fd, dropped, offset - dropped, POSIX_FADV_DONTNEED);
+			dropped = offset;
+		}
+	}
+	if (s->flags & SEGMENT_DROP_BEHIND) {
+		posix_fadvise(s->fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	return status;
+}
+
+/**
+ * Drain a pipe with splice, falling back to read and write.
+ *
+ * @param	fd	Socket file descriptor.
+ * @param	s	Pipe segment.
+ * @param	sent	Incremented by the bytes written.
+ * @return	-1 on error and 0 on success.
+ **/
+static int body_write_pipe(int fd, Segment *s, off_t *sent) {
+	char buffer[BUFSIZ];
+
+	while (true) {
+		ssize_t n = splice(s->fd, NULL, fd, NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n == 0) {
+			return 0;
+		}
+		if (n > 0) {
+			*sent += n;
+			continue;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EINVAL) {
+			break;
+		}
+		log("Unable to splice: %s", strerror(errno));
+		return -1;
+	}
+
+	ssize_t nread;
+	while ((nread = read(s->fd, buffer, BUFSIZ)) != 0) {
+		if (nread < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		for (ssize_t off = 0; off < nread; ) {
+			ssize_t nwritten = write(fd, buffer + off, nread - off);
+			if (nwritten < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return -1;
+			}
+			off += nwritten;
+			*sent += nwritten;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Write response headers and body, then release the body.
+ *
+ * @param	r	HTTP Request structure (headers pending in r->file).
+ * @param	b	Body.
+ * @return	-1 on error and 0 on success.
+ *
+ * This is the one place response bodies reach the socket.  Runs of memory
+ * segments are gathered into a single writev, file ranges go through
+ * sendfile, and pipes through splice, so the bytes are never copied through
+ * a stdio buffer.  Transformations of the body (compression, slicing) are
+ * meant to rewrite the chain before it gets here.
+ *
+ * When the chain holds more than memory, the socket is corked so the
+ * headers and the start of the body still leave in full segments.
+ *
+ * The body bytes that reached the socket are added to b->sent.
+ **/
+int body_write(Request *r, Body *b) {
+	int status = 0;
+	int cork   = 0;
+
+	for (Segment *s = b->head; s && !cork; s = s->next) {
+		cork = s->type != SEGMENT_MEMORY;
+	}
+	if (cork) {
+		setsockopt(r->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	}
+
+	if (fflush(r->file) != 0) {
+		status = -1;
+	}
+
+	Segment *s = b->head;
+	while (s && status == 0) {
+		switch (s->type) {
+			case SEGMENT_MEMORY:
+				status = body_write_memory(r->fd, &s, &b->sent);
+				continue;
+			case SEGMENT_FILE:
+				status = body_write_file(r->fd, s, &b->sent);
+				break;
+			case SEGMENT_PIPE:
+				status = body_write_pipe(r->fd, s, &b->sent);
+				break;
+		}
+		s = s->next;
+	}
+
+	if (cork) {
+		cork = 0;
+		setsockopt(r->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	}
+
+	/* A partially written body leaves the connection unusable */
+	if (status < 0) {
+		r->flags &= ~REQUEST_KEEPALIVE;
+	}
+	body_free(b);
+	return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
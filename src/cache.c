@@ -0,0 +1,192 @@
+/* cache.c: In-Memory File Cache */
+
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CACHE_SLOTS		1024
+#define CACHE_SHARED_SLOTS	4096		/* Popularity counters shared by all workers */
+#define CACHE_DECAY		(1 << 16)	/* Lookups before popularity is halved */
+
+/**
+ * Popularity of files across all workers
+ */
+typedef struct {
+	unsigned long	lookups;			/*< Lookups by all workers */
+	unsigned int	hits[CACHE_SHARED_SLOTS];	/*< Decayed lookups per path hash */
+} Popularity;
+
+static CacheEntry  Cache[CACHE_SLOTS];
+static size_t      CacheBytes = 0;
+static Popularity *Shared     = NULL;		/* Shared by all workers */
+
+/**
+ * Hash path into a cache slot.
+ *
+ * @param	s	File path.
+ * @return	Slot number in Cache.
+ **/
+static size_t cache_slot(const char *s) {
+	unsigned long hash = 5381;
+	while (*s) {
+		hash = ((hash << 5) + hash) + (unsigned char)*s++;
+	}
+	return hash % CACHE_SLOTS;
+}
+
+/**
+ * Allocate the shared popularity counters.
+ *
+ * @return	-1 on error and 0 on success.
+ **/
+int cache_init(void) {
+	Shared = mmap(NULL, sizeof(Popularity), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (Shared == MAP_FAILED) {
+		log("Unable to mmap: %s", strerror(errno));
+		Shared = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Count a lookup of a file by any worker.
+ *
+ * @param	path	Real path of file.
+ * @return	Decayed lookups of the file by all workers (including this one).
+ *
+ * Cache entries are per process, and in forking mode every child starts
+ * with a fresh one, so they cannot tell a popular file from a cold one.
+ * Paths that hash to the same counter share it, which can only make a file
+ * look more popular than it is.  Every CACHE_DECAY lookups all counters are
+ * halved, so files that stop being requested cool down again.
+ **/
+static unsigned int cache_popularity(const char *path) {
+	if (!Shared) {
+		return 0;
+	}
+
+	if (__atomic_add_fetch(&Shared->lookups, 1, __ATOMIC_RELAXED) % CACHE_DECAY == 0) {
+		for (size_t i = 0; i < CACHE_SHARED_SLOTS; i++) {
+			__atomic_store_n(&Shared->hits[i], __atomic_load_n(&Shared->hits[i], __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+		}
+	}
+	size_t slot = hash_bytes(path, strlen(path), HASH_INIT) % CACHE_SHARED_SLOTS;
+	return __atomic_add_fetch(&Shared->hits[slot], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Release the pinned contents of a cache entry.
+ *
+ * @param	e	Cache entry.
+ **/
+static void cache_unpin(CacheEntry *e) {
+	if (e->data) {
+		CacheBytes -= e->size;
+		free(e->data);
+		e->data = NULL;
+	}
+}
+
+/**
+ * Load file contents into a cache entry.
+ *
+ * @param	e	Cache entry.
+ * @param	path	File path.
+ * @param	sb	Stat information of file.
+ *
+ * On failure the entry is simply left unpinned.
+ **/
+static void cache_pin(CacheEntry *e, const char *path, const struct stat *sb) {
+	if (sb->st_size > CACHE_MAX_FILE || CacheBytes + sb->st_size > CACHE_MAX_TOTAL) {
+		return;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log("Unable to open: %s", strerror(errno));
+		return;
+	}
+
+	char *data = malloc(sb->st_size ? sb->st_size : 1);
+	off_t nread = 0;
+	while (data && nread < sb->st_size) {
+		ssize_t n = read(fd, data + nread, sb->st_size - nread);
+		if (n <= 0) {
+			free(data);
+			data = NULL;
+			break;
+		}
+		nread += n;
+	}
+	close(fd);
+
+	if (data) {
+		e->data    = data;
+		CacheBytes += sb->st_size;
+		debug("Pinned %s (%lld bytes, %zu cached)", path, (long long)sb->st_size, CacheBytes);
+	}
+}
+
+/**
+ * Lookup file in cache.
+ *
+ * @param	path	Real path of file.
+ * @param	sb	Stat information of file.
+ * @return	Cache entry for the file (never NULL).
+ *
+ * Every lookup counts as a hit on the file, both in this process and in the
+ * popularity shared by all workers.  Once a file has been requested
+ * CACHE_HOT_HITS times it is considered hot and, if it fits, its contents are
+ * pinned in memory; entry->data is non-NULL when the contents can be served
+ * directly.  Entries are revalidated against the file's mtime and size, and
+ * a different path hashing to the same slot evicts the previous entry.
+ * Within a cache cluster only documents this instance owns are pinned.
+ *
+ * Documents preloaded at startup are served from the shared read-only copy
+ * without touching any slot.
+ *
+ * The returned entry is owned by the cache and is only valid until the next
+ * lookup.
+ **/
+CacheEntry * cache_lookup(const char *path, const struct stat *sb) {
+	static CacheEntry warm;
+	const char *data = warm_file(path, sb);
+	if (data) {
+		warm = (CacheEntry){(char *)path, sb->st_mtim, sb->st_size, CACHE_HOT_HITS, (char *)data, CACHE_HOT_HITS};
+		series_event(SERIES_CACHE_HIT);
+		return &warm;
+	}
+
+	CacheEntry *e = &Cache[cache_slot(path)];
+
+	if (!e->path || !streq(e->path, path)) {
+		cache_unpin(e);
+		free(e->path);
+		e->path = strdup(path);
+		e->hits = 0;
+	} else if (e->mtime.tv_sec != sb->st_mtim.tv_sec || e->mtime.tv_nsec != sb->st_mtim.tv_nsec ||
+		   e->size != sb->st_size) {
+		cache_unpin(e);
+	}
+
+	e->mtime      = sb->st_mtim;
+	e->size       = sb->st_size;
+	e->popularity = cache_popularity(path);
+	e->hits++;
+
+	if (!e->data && e->path && e->hits >= CACHE_HOT_HITS && cluster_local(path)) {
+		cache_pin(e, path, sb);
+	}
+	series_event(e->data ? SERIES_CACHE_HIT : SERIES_CACHE_MISS);
+	return e;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
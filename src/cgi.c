@@ -0,0 +1,323 @@
+/* cgi.c: CGI Script Execution and Accounting */
+
+#include "main.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CGI_SCRIPTS	64		/* Scripts accounted separately */
+#define CGI_PATH	200		/* Longest script path accounted */
+#define CGI_VARIABLES	64		/* Most environment variables passed to a script */
+
+/**
+ * Resource usage accumulated for one script
+ */
+typedef struct {
+	uint64_t	key;			/*< Hash of path or 0 if unused */
+	volatile bool	ready;			/*< Path has been filled in */
+	char		path[CGI_PATH];		/*< Path below RootPath */
+	unsigned long	runs;			/*< Completed runs */
+	unsigned long	failures;		/*< Runs that exited non-zero or were killed */
+	unsigned long	wall;			/*< Wall time in microseconds */
+	unsigned long	user;			/*< User CPU time in microseconds */
+	unsigned long	system;			/*< System CPU time in microseconds */
+	unsigned long	maxrss;			/*< Largest resident set in kilobytes */
+	unsigned long	nvcsw;			/*< Voluntary context switches */
+	unsigned long	nivcsw;			/*< Involuntary context switches */
+	unsigned long	bytes;			/*< Output bytes relayed to clients */
+} Script;
+
+/* Global Variables */
+
+int SlowThreshold = 0;
+
+static Script *Scripts = NULL;		/* Shared by all workers */
+
+/**
+ * Allocate the shared script accounting table.
+ *
+ * @return	-1 on error and 0 on success.
+ **/
+int cgi_init(void) {
+	Scripts = mmap(NULL, CGI_SCRIPTS * sizeof(Script), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (Scripts == MAP_FAILED) {
+		log("Unable to mmap: %s", strerror(errno));
+		Scripts = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Add a variable to a script environment.
+ *
+ * @param	envp	Environment (CGI_VARIABLES entries plus the terminator).
+ * @param	n	Number of variables so far (updated).
+ * @param	prefix	Prefix of the name ("" for none).
+ * @param	name	Name of the variable.
+ * @param	value	Value of the variable.
+ * @return	-1 on error and 0 on success (or if the environment is full).
+ *
+ * Names are upper-cased and dashes turned into underscores, so header names
+ * become variable names as CGI expects.
+ **/
+static int cgi_variable(char **envp, size_t *n, const char *prefix, const char *name, const char *value) {
+	if (*n == CGI_VARIABLES) {
+		return 0;
+	}
+
+	char *variable;
+	if (asprintf(&variable, "%s%s=%s", prefix, name, value ? value : "") < 0) {
+		log("Unable to asprintf: %s", strerror(errno));
+		return -1;
+	}
+	for (char *c = variable + strlen(prefix); *c != '='; c++) {
+		*c = *c == '-' ? '_' : toupper((unsigned char)*c);
+	}
+	envp[(*n)++] = variable;
+	return 0;
+}
+
+/**
+ * Release a script environment.
+ *
+ * @param	envp	Environment.
+ **/
+static void cgi_release(char **envp) {
+	for (char **v = envp; *v; v++) {
+		free(*v);
+	}
+	free(envp);
+}
+
+/**
+ * Build the environment of a CGI script.
+ *
+ * @param	r	HTTP Request structure.
+ * @return	Allocated environment or NULL on error.
+ *
+ * Scripts get the variables of their own request, plus the server's PATH,
+ * and nothing else.  A worker serves many requests, so nothing set for one
+ * of them may end up in its own environment, where the script of the next
+ * request would find it.  Every request header becomes an HTTP_ variable,
+ * except Proxy, which would pose as HTTP_PROXY to the script's own clients.
+ * http://en.wikipedia.org/wiki/Common_Gateway_Interface
+ **/
+static char ** cgi_environment(Request *r) {
+	const char *path = getenv("PATH");
+	const char *variables[][2] = {
+		{"PATH",		path ? path : "/usr/bin:/bin"},
+		{"DOCUMENT_ROOT",	RootPath},
+		{"QUERY_STRING",	r->peer->query},
+		{"REMOTE_ADDR",		r->peer->host},
+		{"REMOTE_PORT",		r->peer->port},
+		{"REQUEST_METHOD",	r->method},
+		{"REQUEST_URI",		r->uri},
+		{"SCRIPT_FILENAME",	r->path},
+		{"SERVER_PORT",		Port},
+	};
+
+	char **envp = calloc(CGI_VARIABLES + 1, sizeof(char *));
+	size_t n    = 0;
+	if (!envp) {
+		log("Unable to calloc: %s", strerror(errno));
+		return NULL;
+	}
+
+	for (size_t i = 0; i < sizeof(variables) / sizeof(variables[0]); i++) {
+		if (cgi_variable(envp, &n, "", variables[i][0], variables[i][1]) < 0) {
+			goto fail;
+		}
+	}
+	for (Header *h = r->headers; h < r->headers + r->nheaders; h++) {
+		if (strcasecmp(h->name, "Proxy") != 0 && cgi_variable(envp, &n, "HTTP_", h->name, h->value) < 0) {
+			goto fail;
+		}
+	}
+	return envp;
+
+fail:
+	cgi_release(envp);
+	return NULL;
+}
+
+/**
+ * Start a CGI script.
+ *
+ * @param	r	HTTP Request structure of the script.
+ * @param	fd	Set to the read end of the script's output.
+ * @return	Process id of the script or -1 on error.
+ *
+ * The script is run directly (falling back to /bin/sh for files without an
+ * interpreter line, as popen would) so its process id is known and it can
+ * be waited for individually.  Its environment is built for the request
+ * alone and passed to execve.  SIGPIPE is restored so a script writing to
+ * a client that went away dies instead of spinning on EPIPE.
+ **/
+pid_t cgi_spawn(Request *r, int *fd) {
+	char **envp = cgi_environment(r);
+	if (!envp) {
+		return -1;
+	}
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		log("Unable to pipe: %s", strerror(errno));
+		cgi_release(envp);
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		log("Unable to fork: %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		cgi_release(envp);
+		return -1;
+	}
+
+	if (pid == 0) {
+		signal(SIGPIPE, SIG_DFL);
+		if (dup2(fds[1], STDOUT_FILENO) < 0) {
+			_exit(EXIT_FAILURE);
+		}
+		char *argv[] = {r->path, NULL};
+		execve(r->path, argv, envp);
+		if (errno == ENOEXEC) {
+			char *shell[] = {"/bin/sh", r->path, NULL};
+			execve(shell[0], shell, envp);
+		}
+		_exit(127);
+	}
+
+	close(fds[1]);
+	cgi_release(envp);
+	*fd = fds[0];
+	series_event(SERIES_CGI_SPAWN);
+	return pid;
+}
+
+/**
+ * Find or claim the accounting entry of a script.
+ *
+ * @param	path	Path below RootPath.
+ * @return	Entry or NULL if the table is full or the path cannot be a label.
+ **/
+static Script * cgi_script(const char *path) {
+	uint64_t key = hash_bytes(path, strlen(path), HASH_INIT) | 1;
+
+	/* Paths are used as metric labels as is */
+	if (path[strcspn(path, "\"\\\n")]) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < CGI_SCRIPTS; i++) {
+		Script  *s      = &Scripts[(key + i) % CGI_SCRIPTS];
+		uint64_t unused = 0;
+		if (__atomic_compare_exchange_n(&s->key, &unused, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			snprintf(s->path, CGI_PATH, "%s", path);
+			__atomic_store_n(&s->ready, true, __ATOMIC_RELEASE);
+			return s;
+		}
+		if (unused == key) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Wait for a CGI script and account for its resource usage.
+ *
+ * @param	r	HTTP Request structure of the script.
+ * @param	pid	Process id of the script.
+ * @param	started	When the script was started (monotonic_ms).
+ * @param	bytes	Output bytes relayed to the client.
+ *
+ * The script's CPU time, peak RSS, and context switches come from wait4, and
+ * are added to the totals for its path along with wall time and output size.
+ * Runs slower than SlowThreshold milliseconds are logged with all of it.
+ **/
+void cgi_account(Request *r, pid_t pid, long started, off_t bytes) {
+	struct rusage ru;
+	int status;
+
+	while (wait4(pid, &status, 0, &ru) < 0) {
+		if (errno != EINTR) {
+			log("Unable to wait4: %s", strerror(errno));
+			return;
+		}
+	}
+
+	long wall   = monotonic_ms() - started;
+	long user   = ru.ru_utime.tv_sec * 1000000L + ru.ru_utime.tv_usec;
+	long system = ru.ru_stime.tv_sec * 1000000L + ru.ru_stime.tv_usec;
+	bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	const char *path = r->path + strlen(RootPath);
+
+	if (failed) {
+		log("CGI %s %s %d", path, WIFEXITED(status) ? "exited with" : "killed by signal",
+			WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+	}
+	if (SlowThreshold > 0 && wall >= SlowThreshold) {
+		log("SLOW CGI %s: wall %ldms user %ldms system %ldms maxrss %ldkB csw %ld/%ld bytes %lld",
+			path, wall, user / 1000, system / 1000, ru.ru_maxrss, ru.ru_nvcsw, ru.ru_nivcsw, (long long)bytes);
+	}
+
+	Script *s = Scripts ? cgi_script(path) : NULL;
+	if (!s) {
+		return;
+	}
+	__atomic_add_fetch(&s->runs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->failures, failed, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->wall, wall * 1000, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->user, user, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->system, system, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->nvcsw, ru.ru_nvcsw, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->nivcsw, ru.ru_nivcsw, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->bytes, bytes, __ATOMIC_RELAXED);
+
+	unsigned long maxrss = __atomic_load_n(&s->maxrss, __ATOMIC_RELAXED);
+	while ((unsigned long)ru.ru_maxrss > maxrss &&
+	       !__atomic_compare_exchange_n(&s->maxrss, &maxrss, ru.ru_maxrss, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Write per-script metrics in text exposition format.
+ *
+ * @param	fs	Stream to write to.
+ **/
+void write_cgi_metrics(FILE *fs) {
+	if (!Scripts) {
+		return;
+	}
+
+	for (size_t i = 0; i < CGI_SCRIPTS; i++) {
+		Script *s = &Scripts[i];
+		if (!__atomic_load_n(&s->ready, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		const char *p = s->path;
+		fprintf(fs, "cgi_runs_total{script=\"%s\"} %lu\n", p, __atomic_load_n(&s->runs, __ATOMIC_RELAXED));
+		fprintf(fs, "cgi_failures_total{script=\"%s\"} %lu\n", p, __atomic_load_n(&s->failures, __ATOMIC_RELAXED));
+		fprintf(fs, "cgi_wall_seconds_total{script=\"%s\"} %.6f\n", p, __atomic_load_n(&s->wall, __ATOMIC_RELAXED) / 1e6);
+		fprintf(fs, "cgi_cpu_seconds_total{script=\"%s\",mode=\"user\"} %.6f\n", p, __atomic_load_n(&s->user, __ATOMIC_RELAXED) / 1e6);
+		fprintf(fs, "cgi_cpu_seconds_total{script=\"%s\",mode=\"system\"} %.6f\n", p, __atomic_load_n(&s->system, __ATOMIC_RELAXED) / 1e6);
+		fprintf(fs, "cgi_max_rss_bytes{script=\"%s\"} %lu\n", p, __atomic_load_n(&s->maxrss, __ATOMIC_RELAXED) * 1024);
+		fprintf(fs, "cgi_context_switches_total{script=\"%s\",kind=\"voluntary\"} %lu\n", p, __atomic_load_n(&s->nvcsw, __ATOMIC_RELAXED));
+		fprintf(fs, "cgi_context_switches_total{script=\"%s\",kind=\"involuntary\"} %lu\n", p, __atomic_load_n(&s->nivcsw, __ATOMIC_RELAXED));
+		fprintf(fs, "cgi_output_bytes_total{script=\"%s\"} %lu\n", p, __atomic_load_n(&s->bytes, __ATOMIC_RELAXED));
+	}
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,466 @@
+/* cluster.c: Consistent-Hash Cache Sharing Between Server Instances */
+
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CLUSTER_VNODES		64		/* Ring points per member */
+#define CLUSTER_TIMEOUT		200		/* Milliseconds to wait on a peer */
+#define CLUSTER_HEAD_MAX	4096		/* Largest response head from a peer */
+#define CLUSTER_BACKOFF		30		/* Seconds before retrying a miss or a member */
+#define CLUSTER_MISSES		4096		/* Documents remembered as recent misses */
+
+/* Global Variables */
+
+char *ClusterMembers = NULL;
+
+/**
+ * Member of the cache cluster
+ */
+typedef struct {
+	char			*name;		/*< host:port as given in ClusterMembers */
+	struct sockaddr_storage	addr;		/*< Resolved address */
+	socklen_t		addrlen;	/*< Length of address */
+	bool			self;		/*< This instance */
+} Member;
+
+/**
+ * Point on the consistent-hash ring
+ */
+typedef struct {
+	uint64_t	hash;		/*< Position on the ring */
+	size_t		member;		/*< Index of member owning the arc ending here */
+} Point;
+
+static Member *Members  = NULL;
+static size_t  NMembers = 0;
+static Point  *Ring     = NULL;
+static size_t  NPoints  = 0;
+static time_t *Misses   = NULL;		/* Last miss per document hash, then per member (shared) */
+
+/**
+ * Compare ring points by position.
+ **/
+static int cluster_compare(const void *a, const void *b) {
+	const Point *x = a;
+	const Point *y = b;
+	return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+/**
+ * Determine whether an address belongs to this host.
+ *
+ * @param	addr	Address to test.
+ * @param	addrlen	Length of address.
+ * @return	true if a socket can be bound to the address.
+ **/
+static bool cluster_local_address(const struct sockaddr_storage *addr, socklen_t addrlen) {
+	struct sockaddr_storage probe = *addr;
+	if (probe.ss_family == AF_INET) {
+		((struct sockaddr_in *)&probe)->sin_port = 0;
+	} else if (probe.ss_family == AF_INET6) {
+		((struct sockaddr_in6 *)&probe)->sin6_port = 0;
+	} else {
+		return false;
+	}
+
+	int fd = socket(probe.ss_family, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return false;
+	}
+	bool local = bind(fd, (struct sockaddr *)&probe, addrlen) == 0;
+	close(fd);
+	return local;
+}
+
+/**
+ * Resolve and add a cluster member.
+ *
+ * @param	name	Member as host:port.
+ * @return	-1 on error and 0 on success.
+ **/
+static int cluster_add(char *name) {
+	char host[NI_MAXHOST];
+	const char *port = strrchr(name, ':');
+	if (!port) {
+		log("Invalid cluster member %s", name);
+		return -1;
+	}
+	snprintf(host, sizeof(host), "%.*s", (int)(port - name), name);
+
+	struct addrinfo hints = {
+		.ai_family	= AF_UNSPEC,
+		.ai_socktype	= SOCK_STREAM,
+	};
+	struct addrinfo *results;
+	int status = getaddrinfo(host, port + 1, &hints, &results);
+	if (status != 0) {
+		log("Unable to resolve %s: %s", name, gai_strerror(status));
+		return -1;
+	}
+
+	Member *members = realloc(Members, (NMembers + 1) * sizeof(Member));
+	if (!members) {
+		log("Unable to realloc: %s", strerror(errno));
+		freeaddrinfo(results);
+		return -1;
+	}
+	Members = members;
+
+	Member *m = &Members[NMembers++];
+	m->name    = name;
+	m->addrlen = results->ai_addrlen;
+	memcpy(&m->addr, results->ai_addr, results->ai_addrlen);
+	m->self    = streq(port + 1, Port) && cluster_local_address(&m->addr, m->addrlen);
+	freeaddrinfo(results);
+	return 0;
+}
+
+/**
+ * Join the cache cluster.
+ *
+ * @return	-1 on error and 0 on success.
+ *
+ * ClusterMembers lists every instance (this one included) as comma separated
+ * host:port pairs, in any order but naming each instance the same way
+ * everywhere, so that every instance builds the same ring.  This instance is
+ * the member with our Port on an address of this host.  Each member gets
+ * CLUSTER_VNODES points on the ring so ownership is spread evenly and only
+ * moves for a 1/N share of documents when membership changes.
+ **/
+int cluster_init(void) {
+	if (!ClusterMembers) {
+		return 0;
+	}
+
+	for (char *name = strtok(ClusterMembers, ","); name; name = strtok(NULL, ",")) {
+		if (cluster_add(name) < 0) {
+			return -1;
+		}
+	}
+
+	Ring = calloc(NMembers * CLUSTER_VNODES, sizeof(Point));
+	if (!Ring) {
+		log("Unable to calloc: %s", strerror(errno));
+		return -1;
+	}
+
+	Misses = mmap(NULL, (CLUSTER_MISSES + NMembers) * sizeof(time_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (Misses == MAP_FAILED) {
+		log("Unable to mmap: %s", strerror(errno));
+		Misses = NULL;
+		return -1;
+	}
+
+	size_t self = NMembers;
+	for (size_t i = 0; i < NMembers; i++) {
+		uint64_t hash = hash_bytes(Members[i].name, strlen(Members[i].name), HASH_INIT);
+		for (int v = 0; v < CLUSTER_VNODES; v++) {
+			hash = hash_bytes(&v, sizeof(v), hash);
+			Ring[NPoints++] = (Point){hash, i};
+		}
+		if (Members[i].self) {
+			self = i;
+		}
+	}
+	qsort(Ring, NPoints, sizeof(Point), cluster_compare);
+
+	if (self == NMembers) {
+		log("This instance is not among the cluster members; fetching only");
+	}
+	log("Sharing cache with %zu cluster members", NMembers);
+	return 0;
+}
+
+/**
+ * Find the member owning a document.
+ *
+ * @param	path	Real path of document.
+ * @return	Owning member or NULL if there is no cluster.
+ *
+ * Documents are placed by their path below RootPath, which is the same on
+ * every instance regardless of where each keeps its document root.
+ **/
+static Member * cluster_owner(const char *path) {
+	if (!NPoints) {
+		return NULL;
+	}
+
+	const char *key = path + strlen(RootPath);
+	uint64_t hash   = hash_bytes(key, strlen(key), HASH_INIT);
+
+	/* First point at or after the hash, wrapping around the ring */
+	size_t lo = 0;
+	size_t hi = NPoints;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (Ring[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return &Members[Ring[lo % NPoints].member];
+}
+
+/**
+ * Determine whether this instance should cache a document.
+ *
+ * @param	path	Real path of document.
+ * @return	true without a cluster or if this instance owns the document.
+ **/
+bool cluster_local(const char *path) {
+	Member *owner = cluster_owner(path);
+	return !owner || owner->self;
+}
+
+/**
+ * Connect to a member without waiting longer than CLUSTER_TIMEOUT.
+ *
+ * @param	m	Member.
+ * @return	Connected socket file descriptor or -1 on error.
+ **/
+static int cluster_connect(const Member *m) {
+	struct timeval timeout = {.tv_usec = CLUSTER_TIMEOUT * 1000};
+	struct pollfd pfd = {.events = POLLOUT};
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	int fd = socket(m->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (const struct sockaddr *)&m->addr, m->addrlen) < 0) {
+		pfd.fd = fd;
+		if (errno != EINPROGRESS || poll(&pfd, 1, CLUSTER_TIMEOUT) != 1 ||
+		    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	return fd;
+}
+
+/**
+ * Read a peer response carrying exactly one document.
+ *
+ * @param	fd	Socket connected to the peer.
+ * @param	size	Expected document size.
+ * @return	Allocated document contents or NULL on a miss or error.
+ *
+ * Only the head and Content-Length bytes are read, so the peer's close is
+ * never waited for.
+ **/
+static char * cluster_read(int fd, off_t size) {
+	char   *data = malloc(size + CLUSTER_HEAD_MAX);
+	size_t  n    = 0;
+	char   *body = NULL;
+
+	while (data && (!body || (size_t)(body - data) + size > n)) {
+		ssize_t nread = read(fd, data + n, size + CLUSTER_HEAD_MAX - n);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread <= 0) {
+			goto fail;
+		}
+		n += nread;
+
+		if (!body && (body = memmem(data, n, "\r\n\r\n", 4))) {
+			body += 4;
+			if (strncmp(data, "HTTP/1.0 200 ", 13) != 0) {
+				goto fail;
+			}
+		} else if (!body && n == (size_t)size + CLUSTER_HEAD_MAX) {
+			goto fail;
+		}
+	}
+	if (!data || (size_t)(body - data) + size != n) {
+		goto fail;
+	}
+
+	memmove(data, body, size);
+	return data;
+
+fail:
+	free(data);
+	return NULL;
+}
+
+/**
+ * Fetch a document from the member that owns it.
+ *
+ * @param	r	HTTP Request structure.
+ * @param	sb	Stat information of the local copy of the document.
+ * @param	entry	Cache entry of the local copy.
+ * @param	b	Body to append the document to.
+ * @return	-1 if the document must be served locally and 0 on success.
+ *
+ * The internal protocol is a plain GET with an X-Cluster-Fetch header that
+ * carries the size and mtime of the local copy.  The owner answers from its
+ * memory cache only, and only if its copy matches; anything else is a 404,
+ * so a peer never does disk work on another's behalf, and fetches are never
+ * forwarded.
+ *
+ * Since a fetch blocks for up to twice CLUSTER_TIMEOUT, only documents the
+ * owner can hold are fetched: those that fit its cache and are hot across
+ * our own workers (so likely at the owner too).  A document the owner missed
+ * (a forking owner only has its warm arena, for one) and a member that could
+ * not be reached are left alone for CLUSTER_BACKOFF, as recorded in a table
+ * shared by all workers.
+ **/
+int cluster_fetch(Request *r, const struct stat *sb, const CacheEntry *entry, Body *b) {
+	char request[BUFSIZ];
+	Member *owner = cluster_owner(r->path);
+	if (!owner || owner->self || sb->st_size > CACHE_MAX_FILE || entry->popularity < CACHE_HOT_HITS ||
+	    request_header(r, "X-Cluster-Fetch")) {
+		return -1;
+	}
+
+	time_t  now  = time(NULL);
+	time_t *miss = &Misses[hash_bytes(r->path, strlen(r->path), HASH_INIT) % CLUSTER_MISSES];
+	time_t *down = &Misses[CLUSTER_MISSES + (owner - Members)];
+	if (now - __atomic_load_n(miss, __ATOMIC_RELAXED) < CLUSTER_BACKOFF ||
+	    now - __atomic_load_n(down, __ATOMIC_RELAXED) < CLUSTER_BACKOFF) {
+		return -1;
+	}
+
+	int n = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nX-Cluster-Fetch: %lld %lld\r\n\r\n",
+		r->uri, (long long)sb->st_size, (long long)sb->st_mtim.tv_sec);
+	if (n >= (int)sizeof(request)) {
+		return -1;
+	}
+
+	char *data = NULL;
+	int   fd   = cluster_connect(owner);
+	if (fd < 0) {
+		log("Unable to reach cluster member %s", owner->name);
+		__atomic_store_n(down, now, __ATOMIC_RELAXED);
+	} else {
+		if (send(fd, request, n, MSG_NOSIGNAL) == n) {
+			data = cluster_read(fd, sb->st_size);
+		}
+		close(fd);
+	}
+
+	if (!data) {
+		debug("Cluster miss for %s at %s", r->path, owner->name);
+		__atomic_store_n(miss, now, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&Stats->cluster_misses, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	__atomic_add_fetch(&Stats->cluster_hits, 1, __ATOMIC_RELAXED);
+	return body_memory(b, data, sb->st_size, data);
+}
+
+/**
+ * Determine whether a cluster fetch may be answered.
+ *
+ * @param	r	HTTP Request structure.
+ * @param	sb	Stat information of our copy of the document.
+ * @param	entry	Cache entry of the document.
+ * @return	true unless the request is a cluster fetch that must miss.
+ **/
+bool cluster_answer(Request *r, const struct stat *sb, const CacheEntry *entry) {
+	const char *fetch = request_header(r, "X-Cluster-Fetch");
+	long long size;
+	long long mtime;
+
+	if (!fetch) {
+		return true;
+	}
+	return entry->data && sscanf(fetch, "%lld %lld", &size, &mtime) == 2 &&
+		size == (long long)sb->st_size && mtime == (long long)sb->st_mtim.tv_sec;
+}
+
+/**
+ * Extract the host part of an address.
+ *
+ * @param	addr	Address.
+ * @param	host	Set to the address bytes (IPv4-mapped addresses as IPv4).
+ * @return	Number of address bytes or 0 for other families.
+ **/
+static size_t cluster_host(const struct sockaddr_storage *addr, unsigned char host[16]) {
+	static const unsigned char mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+	if (addr->ss_family == AF_INET) {
+		memcpy(host, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+		return 4;
+	}
+	if (addr->ss_family == AF_INET6) {
+		const unsigned char *a = ((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+		if (memcmp(a, mapped, sizeof(mapped)) == 0) {
+			memcpy(host, a + 12, 4);
+			return 4;
+		}
+		memcpy(host, a, 16);
+		return 16;
+	}
+	return 0;
+}
+
+/**
+ * Determine whether a client is a cluster member.
+ *
+ * @param	r	HTTP Request structure.
+ * @return	true if the client connected from the address of a member.
+ **/
+static bool cluster_member(Request *r) {
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	unsigned char client[16];
+	unsigned char member[16];
+
+	if (getpeername(r->fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+		return false;
+	}
+	size_t n = cluster_host(&addr, client);
+	for (size_t i = 0; n && i < NMembers; i++) {
+		if (cluster_host(&Members[i].addr, member) == n && memcmp(client, member, n) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Drop cluster fetch headers that did not come from a cluster member.
+ *
+ * @param	r	HTTP Request structure (parsed).
+ *
+ * Fetches arrive on the public port, so any client could send the header to
+ * keep its requests out of the metrics or to force 404s.  It is only
+ * honoured from the address of a member; any other request loses it before
+ * routing and is served and counted as normal traffic.
+ **/
+void cluster_screen(Request *r) {
+	for (unsigned int i = 0; i < r->nheaders; i++) {
+		if (strcasecmp(r->headers[i].name, "X-Cluster-Fetch") != 0) {
+			continue;
+		}
+		if (cluster_member(r)) {
+			return;
+		}
+
+		log("Ignoring X-Cluster-Fetch from %s", r->peer->host);
+		free(r->headers[i].name);
+		free(r->headers[i].value);
+		r->headers[i--] = r->headers[--r->nheaders];
+	}
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,317 @@
+/* compress.c: Adaptive Response Compression */
+
+#include "main.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Constants */
+
+#define COMPRESS_MIN		256		/* Smallest body worth compressing */
+#define COMPRESS_SAMPLE		250		/* Milliseconds between load samples */
+#define COMPRESS_BEST		9		/* Level used when the server is idle */
+#define COMPRESS_SLOTS		256		/* Compressed variants kept per worker */
+#define COMPRESS_MAX_TOTAL	(8 << 20)	/* Bytes of compressed variants kept per worker */
+
+/**
+ * Compressed variant of a file produced at COMPRESS_BEST
+ */
+typedef struct {
+	char		*path;		/*< Real path of file (NULL if unused) */
+	struct timespec	mtime;		/*< File mtime when compressed */
+	off_t		size;		/*< File size when compressed */
+	char		*data;		/*< Compressed contents */
+	size_t		length;		/*< Compressed length */
+} Variant;
+
+/**
+ * CPU load sampled by whichever worker finds the last sample stale
+ */
+typedef struct {
+	CpuSample	sample;		/*< Counters at the last sample */
+	long		sampled;	/*< When it was taken (monotonic_ms) */
+	unsigned int	load;		/*< Utilisation since the one before (per mille) */
+} Load;
+
+static Variant Variants[COMPRESS_SLOTS];
+static size_t  VariantBytes = 0;
+static Load   *Shared       = NULL;		/* Shared by all workers */
+
+/**
+ * Allocate the shared load sample.
+ *
+ * @return	-1 on error and 0 on success.
+ **/
+int compress_init(void) {
+	Shared = mmap(NULL, sizeof(Load), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (Shared == MAP_FAILED) {
+		log("Unable to mmap: %s", strerror(errno));
+		Shared = NULL;
+		return -1;
+	}
+	cpu_utilisation(&Shared->sample);
+	Shared->sampled = monotonic_ms();
+	return 0;
+}
+
+/**
+ * Determine CPU utilisation.
+ *
+ * @return	Utilisation as of the last sample.
+ *
+ * The sample is shared, so /proc/stat is read once per COMPRESS_SAMPLE by
+ * the whole server rather than by every worker, and a freshly forked child
+ * sees the current load instead of the load since boot.
+ **/
+static double compress_cpu(void) {
+	if (!Shared) {
+		return 0;
+	}
+
+	long now  = monotonic_ms();
+	long last = __atomic_load_n(&Shared->sampled, __ATOMIC_ACQUIRE);
+	if (now - last >= COMPRESS_SAMPLE &&
+	    __atomic_compare_exchange_n(&Shared->sampled, &last, now, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		double busy = cpu_utilisation(&Shared->sample);
+		__atomic_store_n(&Shared->load, (unsigned int)(busy * 1000), __ATOMIC_RELAXED);
+	}
+	return __atomic_load_n(&Shared->load, __ATOMIC_RELAXED) / 1000.0;
+}
+
+/**
+ * Load thresholds and the level used below each (checked in order)
+ */
+static const struct {
+	double	load;
+	int	level;
+} Levels[] = {
+	{0.25, COMPRESS_BEST},
+	{0.50, 6},
+	{0.75, 4},
+	{0.90, 1},
+};
+
+/**
+ * Determine whether a mimetype is worth compressing.
+ *
+ * @param	mimetype	Mimetype of body.
+ * @return	true for text and text-like formats.
+ **/
+static bool compress_type(const char *mimetype) {
+	return strncmp(mimetype, "text/", 5) == 0 || strstr(mimetype, "javascript") ||
+		strstr(mimetype, "json") || strstr(mimetype, "xml");
+}
+
+/**
+ * Determine whether the client accepts gzip.
+ *
+ * @param	r	HTTP Request structure.
+ * @return	true unless gzip is absent or refused with q=0.
+ **/
+static bool compress_accepted(Request *r) {
+	const char *accept = request_header(r, "Accept-Encoding");
+	const char *gzip   = accept ? strstr(accept, "gzip") : NULL;
+	if (!gzip) {
+		return false;
+	}
+	gzip += 4;
+	gzip += strspn(gzip, " ");
+	if (*gzip != ';') {
+		return true;
+	}
+	gzip = strstr(gzip, "q=");
+	return !gzip || strtod(gzip + 2, NULL) > 0;
+}
+
+/**
+ * Choose a compression level for the current load.
+ *
+ * @return	zlib level or 0 to not compress at all.
+ *
+ * Load is the larger of CPU utilisation, sampled at most every
+ * COMPRESS_SAMPLE milliseconds, and how full the request capacity is, which
+ * stands in for scheduling lag: requests piling up means they are waiting.
+ **/
+static int compress_level(void) {
+	double cpu   = compress_cpu();
+	double queue = MaxRequests > 0 ?
+		(double)__atomic_load_n(&Stats->total, __ATOMIC_RELAXED) / MaxRequests : 0;
+	double load  = cpu > queue ? cpu : queue;
+	for (size_t i = 0; i < sizeof(Levels) / sizeof(Levels[0]); i++) {
+		if (load < Levels[i].load) {
+			return Levels[i].level;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Read a whole body into memory.
+ *
+ * @param	b	Body of memory and file segments.
+ * @param	length	Length of body.
+ * @return	Allocated contents or NULL on error (or if the body has a pipe).
+ **/
+static char * compress_gather(const Body *b, off_t length) {
+	char *data = malloc(length);
+	off_t n    = 0;
+
+	for (Segment *s = b->head; data && s; s = s->next) {
+		if (s->type == SEGMENT_MEMORY) {
+			memcpy(data + n, s->data, s->length);
+			n += s->length;
+		} else if (s->type == SEGMENT_FILE) {
+			for (off_t off = 0; off < s->length; ) {
+				ssize_t nread = pread(s->fd, data + n, s->length - off, s->offset + off);
+				if (nread <= 0) {
+					free(data);
+					return NULL;
+				}
+				off += nread;
+				n   += nread;
+			}
+		} else {
+			free(data);
+			return NULL;
+		}
+	}
+	return data;
+}
+
+/**
+ * Compress bytes in gzip format.
+ *
+ * @param	data	Bytes to compress.
+ * @param	n	Number of bytes.
+ * @param	level	zlib level.
+ * @param	length	Set to the compressed length.
+ * @return	Allocated compressed bytes or NULL on error.
+ **/
+static char * compress_gzip(const char *data, size_t n, int level, size_t *length) {
+	z_stream z = {0};
+	if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+
+	size_t bound = deflateBound(&z, n);
+	char  *out   = malloc(bound);
+	if (out) {
+		z.next_in   = (Bytef *)data;
+		z.avail_in  = n;
+		z.next_out  = (Bytef *)out;
+		z.avail_out = bound;
+		if (deflate(&z, Z_FINISH) == Z_STREAM_END) {
+			*length = z.total_out;
+		} else {
+			free(out);
+			out = NULL;
+		}
+	}
+	deflateEnd(&z);
+	return out;
+}
+
+/**
+ * Lookup the variant slot of a file.
+ *
+ * @param	path	Real path of file.
+ * @param	sb	Stat information of file.
+ * @param	valid	Set to whether the slot holds a current variant of the file.
+ * @return	Slot of the file.
+ **/
+static Variant * compress_variant(const char *path, const struct stat *sb, bool *valid) {
+	Variant *v = &Variants[hash_bytes(path, strlen(path), HASH_INIT) % COMPRESS_SLOTS];
+	*valid = v->path && streq(v->path, path) && v->size == sb->st_size &&
+		v->mtime.tv_sec == sb->st_mtim.tv_sec && v->mtime.tv_nsec == sb->st_mtim.tv_nsec;
+	return v;
+}
+
+/**
+ * Keep a variant produced at COMPRESS_BEST.
+ *
+ * @param	v	Slot of the file.
+ * @param	path	Real path of file.
+ * @param	sb	Stat information of file.
+ * @param	data	Compressed contents (owned by the slot on success).
+ * @param	length	Compressed length.
+ * @return	true if the slot took ownership of data.
+ **/
+static bool compress_keep(Variant *v, const char *path, const struct stat *sb, char *data, size_t length) {
+	size_t bytes = VariantBytes - (v->data ? v->length : 0) + length;
+	char  *name  = bytes <= COMPRESS_MAX_TOTAL ? strdup(path) : NULL;
+	if (!name) {
+		return false;
+	}
+
+	VariantBytes = bytes;
+	free(v->path);
+	free(v->data);
+	*v = (Variant){name, sb->st_mtim, sb->st_size, data, length};
+	return true;
+}
+
+/**
+ * Compress a response body and write the matching headers.
+ *
+ * @param	r		HTTP Request structure.
+ * @param	b		Body (replaced by its compressed form).
+ * @param	mimetype	Mimetype of body.
+ * @param	sb		Stat information if the body is a whole file, or NULL.
+ *
+ * The level follows the load: COMPRESS_BEST when the server is idle,
+ * cheaper levels as it gets busier, and no compression at all when it is
+ * saturated, so bandwidth is only traded for CPU that is actually spare.
+ * Files compressed at COMPRESS_BEST are kept per worker and served as is
+ * until they change, however busy the server is by then.
+ *
+ * Must be called before the Content-Length is written.
+ **/
+void write_encoding_headers(Request *r, Body *b, const char *mimetype, const struct stat *sb) {
+	off_t length = body_length(b);
+	if (length < COMPRESS_MIN || length > CACHE_MAX_FILE || !compress_type(mimetype)) {
+		return;
+	}
+	fputs("Vary: Accept-Encoding\r\n", r->file);
+	if (!compress_accepted(r)) {
+		return;
+	}
+
+	bool     valid   = false;
+	Variant *variant = sb ? compress_variant(r->path, sb, &valid) : NULL;
+	char    *data    = NULL;
+	size_t   n       = 0;
+	bool     kept    = valid;
+
+	if (valid) {
+		data = variant->data;
+		n    = variant->length;
+		__atomic_add_fetch(&Stats->compress_cached, 1, __ATOMIC_RELAXED);
+	} else {
+		int   level = compress_level();
+		char *plain = level ? compress_gather(b, length) : NULL;
+		if (!plain) {
+			return;
+		}
+		data = compress_gzip(plain, length, level, &n);
+		free(plain);
+		if (!data || n >= (size_t)length) {
+			free(data);
+			return;
+		}
+		if (variant && level == COMPRESS_BEST) {
+			kept = compress_keep(variant, r->path, sb, data, n);
+		}
+	}
+
+	body_free(b);
+	body_memory(b, data, n, kept ? NULL : data);
+	__atomic_add_fetch(&Stats->compressed, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&Stats->compress_saved, length - n, __ATOMIC_RELAXED);
+	fputs("Content-Encoding: gzip\r\n", r->file);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,158 @@
+/* connection.c: Persistent Connection Handling */
+
+#include "main.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define LINGER_CLIENT	100		/* Milliseconds to let the client close first */
+#define LINGER_TIMEOUT	2000		/* Milliseconds to drain a closing connection */
+#define LINGER_MAX	(64 << 10)	/* Unread bytes drained before giving up */
+
+/* Global Variables */
+
+bool ConnectionLinger = true;
+
+/**
+ * Wait for the next request on an idle connection.
+ *
+ * @param	r	Parked request structure.
+ * @return	true if data arrived, false on timeout, hangup, or error.
+ **/
+static bool wait_request(Request *r) {
+	struct pollfd pfd = {
+		.fd	= r->fd,
+		.events	= POLLIN,
+	};
+
+	int n;
+	do {
+		n = poll(&pfd, 1, KeepAliveTimeout * 1000);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		log("Unable to poll: %s", strerror(errno));
+		return false;
+	}
+	if (n == 0 || !(pfd.revents & POLLIN)) {
+		return false;
+	}
+
+	/* Readable with nothing to read means the client closed */
+	char c;
+	return recv(r->fd, &c, 1, MSG_PEEK) > 0;
+}
+
+/**
+ * Serve requests on a client connection until it closes.
+ *
+ * @param	r	Request structure (deallocated before returning).
+ *
+ * Each request is handled in turn for as long as the client and the handler
+ * agree to keep the connection alive.  Between requests the connection is
+ * parked: the stream buffers and parsed state are released and only the
+ * small Request stub is held until data arrives or KeepAliveTimeout expires.
+ **/
+void serve_connection(Request *r) {
+	while (true) {
+		handle_request(r);
+		fflush(r->file);
+
+		if (!(r->flags & REQUEST_KEEPALIVE)) {
+			break;
+		}
+
+		/* Pipelined input is already buffered in r->in; handle it right away */
+		if (!park_request(r)) {
+			continue;
+		}
+
+		debug("Parked connection from %s:%s", r->peer->host, r->peer->port);
+		if (!wait_request(r) || resume_request(r) < 0) {
+			break;
+		}
+	}
+
+	close_connection(r);
+	free_request(r);
+}
+
+/**
+ * Close a client connection gracefully.
+ *
+ * @param	r	Request structure (freed by the caller).
+ *
+ * Closing a socket with unread input makes the kernel send a RST, which can
+ * destroy the tail of a response the client has not read yet.  So the write
+ * side is shut down first and the read side drained until the client closes
+ * or LINGER_TIMEOUT expires.
+ *
+ * After a response with a Content-Length the client knows it has everything
+ * and usually closes on its own, so it gets LINGER_CLIENT to do so before
+ * the server sends its FIN.  Whichever side closes first holds the TIME_WAIT
+ * state, which this way mostly ends up on the client.
+ *
+ * A server that handles one connection at a time cannot afford to wait, so
+ * without ConnectionLinger only input that has already arrived is drained
+ * before the write side is shut down.
+ **/
+void close_connection(Request *r) {
+	char buffer[BUFSIZ];
+	long deadline = monotonic_ms() + (ConnectionLinger ? LINGER_TIMEOUT : 0);
+	long drained  = 0;
+	bool shut     = !(r->flags & REQUEST_DELIMITED);
+
+	if (r->file) {
+		fflush(r->file);
+	}
+	if (!ConnectionLinger) {
+		ssize_t nread;
+		while (drained < LINGER_MAX && (nread = recv(r->fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+			drained += nread;
+		}
+		shut = true;
+	}
+	if (shut) {
+		shutdown(r->fd, SHUT_WR);
+	}
+
+	long remaining;
+	while ((remaining = deadline - monotonic_ms()) > 0 && drained < LINGER_MAX) {
+		struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+		int n = poll(&pfd, 1, shut || remaining < LINGER_CLIENT ? remaining : LINGER_CLIENT);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			break;
+		}
+		if (n == 0) {
+			if (!shut) {
+				shutdown(r->fd, SHUT_WR);
+				shut = true;
+			}
+			continue;
+		}
+
+		ssize_t nread = recv(r->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if (nread < 0 && (errno == EAGAIN || errno == EINTR)) {
+			continue;
+		}
+		if (nread <= 0) {
+			break;
+		}
+		drained += nread;
+	}
+
+	__atomic_add_fetch(shut ? &Stats->closed_server : &Stats->closed_client, 1, __ATOMIC_RELAXED);
+	metrics_connection(-1);
+	__atomic_add_fetch(&Stats->lingered, drained, __ATOMIC_RELAXED);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,377 @@
+/* dispatch.c: Dispatching HTTP Server with Per-Class Worker Pools */
+
+#include "main.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define DISPATCH_HEAD_MAX	8192	/* Largest request head read by the front */
+#define DISPATCH_TIMEOUT	10	/* Seconds a new connection has to send its head */
+#define DISPATCH_CGI_PREFIX	"/scripts/"	/* URIs sent to the CGI pool */
+#define DISPATCH_BUSY		"HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define DISPATCH_TOO_LARGE	"HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+/* Global Variables */
+
+int DispatchWorkers[NPRIORITIES] = {1, 4, 1, 4};
+
+/**
+ * Connection waiting in the front process for a complete request head
+ */
+typedef struct {
+	int	fd;			/*< Client socket */
+	time_t	deadline;		/*< When to give up on the connection */
+	size_t	length;			/*< Bytes of request head read so far */
+	char	*head;			/*< Request head buffer or NULL until readable */
+} Connection;
+
+static int         Queues[NPRIORITIES][2];	/* Per-pool queues (front end, worker end) */
+static int         Returns[2];			/* Idle connections back to the front */
+static Priority    Pools[MAX_WORKERS];		/* Pool of each scoreboard slot */
+static Connection *Connections  = NULL;
+static size_t      NConnections = 0;
+
+/**
+ * Serve connections handed to one pool until the front process exits.
+ *
+ * @param	pool	Pool served by this worker.
+ * @param	w	Scoreboard slot of this worker.
+ *
+ * Each connection is served for as long as requests are already buffered on
+ * it; once it goes idle it is returned to the front process, which waits for
+ * its next request and routes that one afresh.
+ *
+ * Replacement workers are forked from a running front process, so the server
+ * socket and every connection it is tracking are closed first; otherwise
+ * those connections would stay open for as long as the worker lives.
+ **/
+static void dispatch_worker(Priority pool, Worker *w) {
+	char head[DISPATCH_HEAD_MAX];
+
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	CurrentWorker = w;
+	close(Queues[pool][0]);
+	close(Returns[0]);
+	close(ServerSocket);
+	ServerSocket = -1;
+	for (size_t i = 0; i < NConnections; i++) {
+		close(Connections[i].fd);
+		free(Connections[i].head);
+	}
+	free(Connections);
+	Connections  = NULL;
+	NConnections = 0;
+
+	while (true) {
+		w->state = WORKER_IDLE;
+		size_t n = sizeof(head);
+		int fd = socket_recv_fd(Queues[pool][1], head, &n, 0);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			exit(EXIT_SUCCESS);
+		}
+
+		/* The connection is ours to close until it is handed back */
+		w->state = WORKER_BUSY;
+		metrics_adopt(1);
+		Request *r = adopt_request(fd, head, n);
+		if (!r) {
+			metrics_connection(-1);
+			continue;
+		}
+
+		while (true) {
+			handle_request(r);
+			fflush(r->file);
+			if (!(r->flags & REQUEST_KEEPALIVE) || park_request(r)) {
+				break;
+			}
+		}
+		if (r->flags & REQUEST_PARKED) {
+			if (socket_send_fd(Returns[1], r->fd, "", 1, 0) < 0) {
+				metrics_connection(-1);
+			} else {
+				metrics_adopt(-1);
+			}
+		} else {
+			close_connection(r);
+		}
+		free_request(r);
+	}
+}
+
+/**
+ * Fork a worker into a pool.
+ *
+ * @param	pool	Pool to grow.
+ * @return	-1 on error and 0 on success.
+ **/
+static int dispatch_spawn(Priority pool) {
+	Worker *w = metrics_worker();
+	if (!w) {
+		return -1;
+	}
+	Pools[w - Stats->workers] = pool;
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		log("Unable to fork: %s", strerror(errno));
+		w->state = WORKER_FREE;
+		return -1;
+	}
+	if (pid == 0) {
+		dispatch_worker(pool, w);
+	}
+	w->pid = pid;
+	return 0;
+}
+
+/**
+ * Reap exited workers and replace them.
+ **/
+static void dispatch_reap(void) {
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		Worker *w = metrics_reap(pid);
+		if (w) {
+			Priority pool = Pools[w - Stats->workers];
+			log("Replacing %s worker %d", priority_string(pool), pid);
+			dispatch_spawn(pool);
+		}
+	}
+}
+
+/**
+ * Track a connection in the front process.
+ *
+ * @param	fd	Client socket.
+ * @param	timeout	Seconds to wait for its next request.
+ **/
+static void dispatch_track(int fd, int timeout) {
+	Connection *connections = realloc(Connections, (NConnections + 1) * sizeof(Connection));
+	if (!connections) {
+		log("Unable to realloc: %s", strerror(errno));
+		close(fd);
+		metrics_connection(-1);
+		return;
+	}
+	Connections = connections;
+	Connections[NConnections++] = (Connection){fd, time(NULL) + timeout, 0, NULL};
+}
+
+/**
+ * Stop tracking a connection (the caller closes or has handed off its fd).
+ *
+ * @param	i	Index of connection.
+ **/
+static void dispatch_untrack(size_t i) {
+	free(Connections[i].head);
+	Connections[i] = Connections[--NConnections];
+}
+
+/**
+ * Route a complete request head to a pool.
+ *
+ * @param	c	Connection with a complete head.
+ * @return	Pool that should serve the request.
+ *
+ * Only the method and URI of the request line are looked at, since the
+ * front must never touch the filesystem: health and metrics checks, POSTs and
+ * URIs under DISPATCH_CGI_PREFIX, and directories (a trailing slash) each go
+ * to their own pool, everything else to the static pool.  The worker still
+ * routes the request itself from the filesystem, so a request sent to the
+ * wrong pool is served correctly and admitted under its real class.
+ * Classes without a pool of their own also fall back to the static pool.
+ **/
+static Priority dispatch_route(Connection *c) {
+	const char *end    = c->head + c->length;
+	const char *method = c->head;
+	const char *uri    = memchr(method, ' ', c->length);
+	Priority priority  = PRIORITY_STATIC;
+
+	if (uri) {
+		uri++;
+		size_t n = 0;
+		while (uri + n < end && uri[n] != ' ' && uri[n] != '?' && uri[n] != '\r' && uri[n] != '\n') {
+			n++;
+		}
+
+		if ((n == strlen(HEALTH_URI) && strncmp(uri, HEALTH_URI, n) == 0) ||
+		    (n == strlen(METRICS_URI) && strncmp(uri, METRICS_URI, n) == 0)) {
+			priority = PRIORITY_HEALTH;
+		} else if (strncmp(method, "POST ", 5) == 0 ||
+			   (n >= strlen(DISPATCH_CGI_PREFIX) && strncmp(uri, DISPATCH_CGI_PREFIX, strlen(DISPATCH_CGI_PREFIX)) == 0)) {
+			priority = PRIORITY_CGI;
+		} else if (n > 0 && uri[n - 1] == '/') {
+			priority = PRIORITY_BROWSE;
+		}
+	}
+	return DispatchWorkers[priority] > 0 ? priority : PRIORITY_STATIC;
+}
+
+/**
+ * Read from a connection and dispatch it once its head is complete.
+ *
+ * @param	i	Index of connection.
+ * @return	true if the connection was handed off or closed.
+ **/
+static bool dispatch_read(size_t i) {
+	Connection *c = &Connections[i];
+	if (!c->head && !(c->head = malloc(DISPATCH_HEAD_MAX))) {
+		return false;
+	}
+
+	ssize_t n = recv(c->fd, c->head + c->length, DISPATCH_HEAD_MAX - c->length, MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return false;
+	}
+	if (n <= 0) {
+		goto close;
+	}
+	c->length += n;
+
+	if (!memmem(c->head, c->length, "\n\r\n", 3) && !memmem(c->head, c->length, "\n\n", 2)) {
+		if (c->length < DISPATCH_HEAD_MAX) {
+			return false;
+		}
+		send(c->fd, DISPATCH_TOO_LARGE, strlen(DISPATCH_TOO_LARGE), MSG_DONTWAIT | MSG_NOSIGNAL);
+		goto close;
+	}
+
+	/* Hand the connection and its head to the pool without ever blocking */
+	watchdog_phase("route", c->fd, c->head, c->length);
+	Priority pool = dispatch_route(c);
+	if (socket_send_fd(Queues[pool][0], c->fd, c->head, c->length, MSG_DONTWAIT) == 0) {
+		close(c->fd);
+		dispatch_untrack(i);
+		return true;
+	}
+	log("Unable to dispatch to %s pool: %s", priority_string(pool), strerror(errno));
+	__atomic_add_fetch(&Stats->rejected[pool], 1, __ATOMIC_RELAXED);
+	send(c->fd, DISPATCH_BUSY, strlen(DISPATCH_BUSY), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+close:
+	close(c->fd);
+	dispatch_untrack(i);
+	metrics_connection(-1);
+	return true;
+}
+
+/**
+ * Serve HTTP requests by dispatching connections to per-class worker pools.
+ *
+ * @param	sfd	Server socket file descriptor.
+ * @return	Exit status of the server (EXIT_SUCCESS).
+ *
+ * The front process only accepts connections and reads request heads, never
+ * blocking on any one client.  Each complete head is routed and passed, with
+ * the connection itself (SCM_RIGHTS), to the pre-forked pool of its priority
+ * class, where the regular handlers serve it.  A slow CGI script can then
+ * only ever occupy a CGI worker, never one that serves static files.  Pools
+ * with a full queue are answered with 503 by the front process directly.
+ * Idle keep-alive connections come back to the front process to wait.
+ * Each iteration is watched, so anything that blocks the front is logged.
+ * The front also samples the listen queue every second for the workers.
+ **/
+int dispatch_server(int sfd) {
+	struct pollfd *pfds    = NULL;
+	time_t         sampled = 0;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, Returns) < 0) {
+		log("Unable to socketpair: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	for (Priority p = 0; p < NPRIORITIES; p++) {
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, Queues[p]) < 0) {
+			log("Unable to socketpair: %s", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		for (int i = 0; i < DispatchWorkers[p]; i++) {
+			dispatch_spawn(p);
+		}
+	}
+	if (watchdog_start() < 0) {
+		return EXIT_FAILURE;
+	}
+
+	while (true) {
+		/* Poll the server socket, returned connections, and waiting ones */
+		struct pollfd *grown = realloc(pfds, (NConnections + 2) * sizeof(struct pollfd));
+		if (!grown) {
+			log("Unable to realloc: %s", strerror(errno));
+			sleep(1);
+			continue;
+		}
+		pfds = grown;
+		pfds[0] = (struct pollfd){.fd = sfd, .events = POLLIN};
+		pfds[1] = (struct pollfd){.fd = Returns[0], .events = POLLIN};
+		for (size_t i = 0; i < NConnections; i++) {
+			pfds[i + 2] = (struct pollfd){.fd = Connections[i].fd, .events = POLLIN};
+		}
+
+		size_t npolled = NConnections;
+		watchdog_idle();
+		if (poll(pfds, npolled + 2, 1000) < 0 && errno != EINTR) {
+			log("Unable to poll: %s", strerror(errno));
+		}
+		watchdog_busy();
+		time_t now = time(NULL);
+		if (now != sampled) {
+			metrics_sample_listen(sfd);
+			sampled = now;
+		}
+
+		/* Existing connections first, newest last, so removal keeps indices valid */
+		for (size_t i = npolled; i-- > 0; ) {
+			if (pfds[i + 2].revents) {
+				watchdog_phase("read", Connections[i].fd, Connections[i].head, Connections[i].length);
+				dispatch_read(i);
+			} else if (now >= Connections[i].deadline) {
+				close(Connections[i].fd);
+				dispatch_untrack(i);
+				metrics_connection(-1);
+			}
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			watchdog_phase("accept", sfd, NULL, 0);
+			int fd = accept(sfd, NULL, NULL);
+			if (fd < 0) {
+				log("Unable to accept: %s", strerror(errno));
+			} else {
+				metrics_connection(1);
+				dispatch_track(fd, DISPATCH_TIMEOUT);
+			}
+		}
+
+		if (pfds[1].revents & POLLIN) {
+			watchdog_phase("return", Returns[0], NULL, 0);
+			char c;
+			size_t n = 1;
+			int fd;
+			while ((fd = socket_recv_fd(Returns[0], &c, &n, MSG_DONTWAIT)) >= 0) {
+				dispatch_track(fd, KeepAliveTimeout);
+				n = 1;
+			}
+		}
+
+		watchdog_phase("reap", -1, NULL, 0);
+		dispatch_reap();
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,9 +3,9 @@
 #include "main.h"
 
 #include <errno.h>
-#include <signal.h>
 #include <string.h>
 
+#include <sys/wait.h>
 #include <unistd.h>
 
 /**
@@ -15,28 +15,53 @@
  * @return 	Exit status of the server (EXIT_SUCCESS).
  *
  * The parent should accept a request and then fork off and let the child
- * handle the request.
+ * handle the request.  Since each child serves a single connection, it may
+ * be reniced according to the priority class of its request.
+ *
+ * Each child takes a scoreboard slot while there is one free, so that the
+ * capacity it was admitted with is released when it is reaped even if it was
+ * killed mid-request.  Children are reaped after every accept.
  **/
 int forking_server(int sfd) {
+	PriorityRenice = true;
+
 	/* Accept and handle HTTP request */
 	while (true) {
 		/* Accept Request */
 		Request *r = accept_request(sfd);
-		
-		/* Ignore children */
-		signal(SIGCHLD,SIG_IGN);
+
+		/* Reap children */
+		pid_t pid;
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+			metrics_reap(pid);
+		}
+		if (!r) {
+			continue;
+		}
 
 		/* Fork off child process to handle the request */
-		pid_t pid = fork();
+		Worker *w = metrics_worker();
+		pid = fork();
 		if (pid < 0) {
+			if (w) {
+				w->state = WORKER_FREE;
+			}
 			free_request(r);
 			continue;
 		}
 		if (pid == 0) {
-			handle_request(r);
+			CurrentWorker = w;
+			if (w) {
+				w->state = WORKER_BUSY;
+			}
+			metrics_adopt(1);
+			serve_connection(r);
 			exit(EXIT_SUCCESS);
 		}
 		else {
+			if (w) {
+				w->pid = pid;
+			}
 			free_request(r);
 		}
 	}
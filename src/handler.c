@@ -7,6 +7,7 @@
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -14,66 +15,156 @@
 Status handle_browse_request(Request *request);
 Status handle_file_request(Request *request);
 Status handle_cgi_request(Request *request);
-Status handle_error(Request *request, Status status);
+Status handle_health_request(Request *request);
+void   relay_cgi_conditional(Request *request, int fd, Body *body);
 
 /**
- * Handle HTTP Request.
+ * Route a parsed HTTP Request.
  *
- * @param	r		HTTP request structure.
- * @return	Status of the HTTP request.
+ * @param	r		Parsed HTTP request structure.
+ * @param	handler		Set to the handler of the request.
+ * @param	priority	Set to the priority class of the request.
+ * @return	HTTP_STATUS_OK if the request was routed, otherwise the error
+ * status to respond with.
  *
- * This parses a request, determines the request path, determines the request type,
- * and then dispatches to the appropriate handler type.
- *
- * On error, handle_error should be used with an appropriate HTTP status code.
+ * This determines the request path (resolving directory index files) and
+ * then the request type from the file type.  Health and metrics checks are
+ * routed without touching the filesystem.
  **/
-Status handle_request(Request *r){
-	Status result;
-
-	/* Parse request */
-	if (parse_request(r) < 0) {
-		return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+Status route_request(Request *r, Handler *handler, Priority *priority) {
+	if (streq(r->uri, HEALTH_URI)) {
+		*handler  = handle_health_request;
+		*priority = PRIORITY_HEALTH;
+		return HTTP_STATUS_OK;
+	}
+	if (streq(r->uri, METRICS_URI)) {
+		*handler  = handle_metrics_request;
+		*priority = PRIORITY_HEALTH;
+		return HTTP_STATUS_OK;
 	}
 
 	/* Determine request path */
 	r->path = determine_request_path(r->uri);
 	debug("HTTP REQUEST PATH: %s", r->path);
 	if(!r->path) {
-		return handle_error(r, HTTP_STATUS_NOT_FOUND);
+		return HTTP_STATUS_NOT_FOUND;
 	}
 
 	/* Dispatch to appropriate request handler type based on file type */
 	struct stat sb;
 	if (stat(r->path, &sb) == -1) {
 		log("Unable to stat %s", strerror(errno));
-		return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+		return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+	}
+
+	/* Serve the directory index file instead of a listing when present */
+	if (S_ISDIR(sb.st_mode)) {
+		struct stat isb;
+		char *index = determine_index_path(r->path, &sb);
+		if (index && stat(index, &isb) == 0) {
+			debug("HTTP INDEX PATH: %s", index);
+			free(r->path);
+			r->path = index;
+			sb = isb;
+		} else {
+			free(index);
+		}
 	}
 
 	if(S_ISDIR(sb.st_mode)) {			// if file is DIR
-		log("Handling browse request...");
-		result = handle_browse_request(r);	// Handle DIR
+		*handler  = handle_browse_request;
+		*priority = PRIORITY_BROWSE;
 	} else if (S_ISREG(sb.st_mode)) {		// if file is FILE
 		if (access(r->path, X_OK) == 0) { 	// if file is executable
-			log("Handling CGI request...");
-			result = handle_cgi_request(r);	// handle cgi
+			*handler  = handle_cgi_request;
+			*priority = PRIORITY_CGI;
 		}
 		else if (sb.st_mode & S_IRUSR) {	// if readable
-			log("Handling file request...");
-			result = handle_file_request(r);
+			const char *ext = strrchr(r->path, '.');
+			*handler  = (ext && streq(ext, SSI_EXTENSION)) ? handle_ssi_request : handle_file_request;
+			*priority = PRIORITY_STATIC;
 		} else {
-			result = handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+			return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 		}
 	} else {
-		result = handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+		return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 	}
+	return HTTP_STATUS_OK;
+}
+
+/**
+ * Handle HTTP Request.
+ *
+ * @param	r		HTTP request structure.
+ * @return	Status of the HTTP request.
+ *
+ * This parses a request, routes it to a handler, and then dispatches to that
+ * handler.
+ *
+ * Each request type belongs to a priority class, and the request is only
+ * dispatched if its class has capacity left; otherwise it is rejected with
+ * HTTP_STATUS_SERVICE_UNAVAILABLE.
+ *
+ * On error, handle_error should be used with an appropriate HTTP status code.
+ *
+ * Handling time and the client's TCP state are recorded once the response
+ * is written.
+ **/
+Status handle_request(Request *r){
+	Status result;
+	Handler handler;
+	Priority priority;
+
+	/* Parse request */
+	if (parse_request(r) < 0) {
+		return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+	}
+	cluster_screen(r);
+	mirror_request(r);
+	long started = monotonic_ms();
+
+	if ((result = route_request(r, &handler, &priority)) != HTTP_STATUS_OK) {
+		result = handle_error(r, result);
+		metrics_request(r, started, result);
+		return result;
+	}
+
+	/* Admit request within the capacity of its priority class */
+	if (!priority_admit(r, priority)) {
+		result = handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+		metrics_request(r, started, result);
+		return result;
+	}
+
+	log("Handling %s request...", priority_string(priority));
+	result = handler(r);
+	priority_release(priority);
+	fflush(r->file);
+	metrics_request(r, started, result);
 
-	// inode in stat structure say whether file is executable readable etc..
-	
 	log("HTTP REQUEST STATUS: %s", http_status_string(result));
 	
 	return result;
 }
 
+/**
+ * Handle health check request.
+ *
+ * @param	r	HTTP Request structure.
+ * @return	Status of the HTTP health request.
+ **/
+Status handle_health_request(Request *r) {
+	Body body = {0};
+	body_memory(&body, "OK\n", 3, NULL);
+
+	fprintf(r->file, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_OK));
+	fprintf(r->file, "Content-type: text/plain\r\n");
+	write_connection_headers(r, body_length(&body));
+	fputs("\r\n", r->file);
+	body_write(r, &body);
+	return HTTP_STATUS_OK;
+}
+
 
 /**
  * Filter out current directory "." from scandir
@@ -91,7 +182,9 @@ int filter_curdir(const struct dirent *dir) {
  * @param	r	HTTP Request structure.
  * @return	Status of the HTTP browse request.
  *
- * This lists the contents of a directory in HTML
+ * This lists the contents of a directory in HTML.  The listing is rendered
+ * in memory first, so its length is known and the connection may be kept
+ * alive.
  *
  * If the path cannot be opened or scanned as a directory, then handle error
  * with HTTP_STATUS_NOT_FOUND.
@@ -107,9 +200,6 @@ Status 	handle_browse_request(Request *r) {
 		log("Unable to opendir: %s\n", strerror(errno));
 		return handle_error(r, HTTP_STATUS_NOT_FOUND);
 	}
-	
-	/* Write HTTP header with OK status an text/html Content-type */
-	fputs("HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n",r->file);
 
 	/* For each entry in directory emit HTML list item */
 	n = scandir(r->path, &entries, filter_curdir, alphasort);
@@ -119,10 +209,23 @@ Status 	handle_browse_request(Request *r) {
 		return handle_error(r, HTTP_STATUS_NOT_FOUND);
 	}
 
+	char  *listing = NULL;
+	size_t size    = 0;
+	FILE  *fs      = open_memstream(&listing, &size);
+	if (!fs) {
+		log("Unable to open_memstream: %s", strerror(errno));
+		for (int i = 0; i < n; i++) {
+			free(entries[i]);
+		}
+		free(entries);
+		closedir(d);
+		return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+	}
+
 	/* if the directory already has a trailing / then do not add one at end */
 	const char *separator = (r->uri[strlen(r->uri) - 1] == '/') ? "" : "/";
-	fprintf(r->file,"<h1>Index of %s</h1>\r\n",r->uri);
-	fprintf(r->file,"<ul>\r\n");
+	fprintf(fs,"<h1>Index of %s</h1>\r\n",r->uri);
+	fprintf(fs,"<ul>\r\n");
 	for (int i = 0; i < n; i++) {
 		char *fname = entries[i]->d_name;
 		char *mimetype = determine_mimetype(fname);
@@ -131,24 +234,30 @@ Status 	handle_browse_request(Request *r) {
 
 		snprintf(webpath, BUFSIZ, "%s%s%s",r->uri,separator,fname);
 
-		fprintf(r->file,"\t<li>\r\n");
+		fprintf(fs,"\t<li>\r\n");
 		/* if it's an image add a thumbnail */
 		if (is_image) {
-			fprintf(r->file,"\t\t<img src=\"%s\" width=\"50\">\r\n",webpath);
+			fprintf(fs,"\t\t<img src=\"%s\" width=\"50\">\r\n",webpath);
 		}
-		fprintf(r->file,"\t\t<a class=\"btn btn-primary\" href=\"%s\">%s</a>\r\n", webpath, fname);
-		fprintf(r->file,"\t</li>\r\n");
+		fprintf(fs,"\t\t<a class=\"btn btn-primary\" href=\"%s\">%s</a>\r\n", webpath, fname);
+		fprintf(fs,"\t</li>\r\n");
 
 		free(mimetype);
 		free(entries[i]);
 	}
 	free(entries);
-	fprintf(r->file,"</ul>\r\n");
-
-
-	/* Flush socket, return OK */
+	fprintf(fs,"</ul>\r\n");
+	fclose(fs);
 	closedir(d);
-	fflush(r->file);
+
+	/* Write HTTP header with OK status an text/html Content-type, then the listing */
+	Body body = {0};
+	body_memory(&body, listing, size, listing);
+	fputs("HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n",r->file);
+	write_encoding_headers(r, &body, "text/html", NULL);
+	write_connection_headers(r, body_length(&body));
+	fputs("\r\n",r->file);
+	body_write(r, &body);
 	return HTTP_STATUS_OK;
 }
 
@@ -159,49 +268,91 @@ Status 	handle_browse_request(Request *r) {
  * @param	Status of the HTTP file request.
  *
  * This opens and streams the contents of the specified file to the socket
+ * using a policy based on the file's size and popularity:
+ *
+ * - Hot files that fit in the file cache are served from memory.
+ * - Within a cache cluster, hot files owned by another instance are
+ *   fetched from its memory cache when it has them.
+ * - Everything else is sent from the page cache with sendfile, and large
+ *   files get sequential access and readahead hints.
+ * - Huge files that are not hot have their pages dropped from the page
+ *   cache behind the send cursor, so a single large download does not evict
+ *   the small assets everybody else is requesting.
+ *
+ * Caching headers are attached according to the cache policy rules, HTML
+ * pages announce the dependencies learned for them, and text is compressed
+ * as far as the current load allows.
  *
  * If the path cannot be opened for reading, then handle error with 
  * HTTP_STATUS_NOT_FOUND.
  **/
 Status handle_file_request(Request *r) {
-	FILE *fs;
-	char buffer[BUFSIZ];
+	int fd = -1;
 	char *mimetype = NULL;
-	size_t nread;
+	struct stat sb;
+	Body body = {0};
 
 	/* Open file for reading */
-	fs = fopen(r->path, "r");
-	if (!fs) {
-		log("Unable to fopen: %s", strerror(errno));
+	fd = open(r->path, O_RDONLY);
+	if (fd < 0) {
+		log("Unable to open: %s", strerror(errno));
+		goto fail;
+	}
+	if (fstat(fd, &sb) < 0) {
+		log("Unable to fstat: %s", strerror(errno));
 		goto fail;
 	}
 
 	/* Determine mimetype */
 	mimetype = determine_mimetype(r->path);
 	debug("MIME Type: %s", mimetype);
+	snapshot_record(r->path, &sb);
 
-	/* Write HTTP HEADERS with OK status and determined Content-Type */
-	fprintf(r->file, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_OK));
-	fprintf(r->file, "Content-type: %s\r\n\r\n", mimetype);
-
-	/* Read from file and write to socket in chunks */
-	while ((nread = fread(buffer, 1, BUFSIZ, fs)) > 0) {
-		debug("nread = %d", (int)nread);
-		if(fwrite(buffer,1,nread, r->file) <= 0) {
-			log("fwrite error");
-			goto fail;
+	/* Serve hot files straight from memory, everything else from the file */
+	CacheEntry *entry = cache_lookup(r->path, &sb);
+	if (!cluster_answer(r, &sb, entry)) {
+		close(fd);
+		free(mimetype);
+		return handle_error(r, HTTP_STATUS_NOT_FOUND);
+	}
+	if (entry->data) {
+		debug("Serving %s from cache", r->path);
+		body_memory(&body, entry->data, sb.st_size, NULL);
+		close(fd);
+	} else if (cluster_fetch(r, &sb, entry, &body) == 0) {
+		debug("Serving %s from cluster", r->path);
+		close(fd);
+	} else {
+		/* Apply page cache policy for large files */
+		unsigned int flags = SEGMENT_CLOSE;
+		if (sb.st_size >= HUGE_FILE_SIZE && entry->popularity < CACHE_HOT_HITS) {
+			flags |= SEGMENT_DROP_BEHIND;
+		}
+		if (sb.st_size >= LARGE_FILE_SIZE) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			readahead(fd, 0, LARGE_FILE_SIZE);
 		}
+		body_file(&body, fd, 0, sb.st_size, flags);
 	}
 
-	/* Close file, flush socket, deallocate mimetype, return OK */
-	fclose(fs);
-	fflush(r->file);
+	/* Write HTTP HEADERS with OK status and determined Content-Type */
+	fprintf(r->file, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_OK));
+	fprintf(r->file, "Content-type: %s\r\n", mimetype);
+	write_cache_headers(r->file, r->uri, mimetype);
+	write_prefetch_headers(r, mimetype);
+	write_encoding_headers(r, &body, mimetype, &sb);
+	write_connection_headers(r, body_length(&body));
+	fputs("\r\n", r->file);
+
+	/* Send body, deallocate mimetype, return OK */
+	body_write(r, &body);
 	free(mimetype);
 	return HTTP_STATUS_OK;
 
 fail:
 	/* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-	fclose(fs);
+	if (fd >= 0)
+		close(fd);
 	if(mimetype)
 		free(mimetype);
 	return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
@@ -213,61 +364,153 @@ fail:
  * @param	r	HTTP Request structure.
  * @return 	Status of the HTTP file request
  *
- * This popens and streams the results of the specified executables to the socket.
+ * This starts and streams the results of the specified executables to the
+ * socket, then waits for the script and accounts for its resource usage.
  *
- * If the path cannot be popened, then handle error with 
+ * If the script cannot be started, then handle error with
  * HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
 Status 	handle_cgi_request(Request *r) {
-	FILE *pfs;
-	char buffer[BUFSIZ];
+	int fd;
 
-	/* Export CGI enviornment variables from request 
-	 * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
-	setenv("DOCUMENT_ROOT",RootPath,1);
-	setenv("QUERY_STRING",r->query,1);
-	setenv("REMOTE_ADDR",r->host,1);
-	setenv("REMOTE_PORT",r->port,1);
-	setenv("REQUEST_METHOD",r->method,1);
-	setenv("REQUEST_URI",r->uri,1);
-	setenv("SCRIPT_FILENAME",r->path,1);
-	setenv("SERVER_PORT",Port,1);
-
-	for(struct header *head = r->headers; head ; head = head->next) {
-		if(streq(head->name, "Host"))
-			setenv("HTTP_HOST",head->value,1);
-		else if(streq(head->name,"User-Agent"))
-			setenv("HTTP_USER_AGENT",head->value,1);
-		else if(streq(head->name,"Accept"))
-			setenv("HTTP_ACCEPT",head->value,1);
-		else if(streq(head->name,"Accept-Language"))
-			setenv("HTTP_ACCEPT",head->value,1);
-		else if(streq(head->name,"Accept-Encoding"))
-			setenv("HTTP_ACCEPT_ENCODING",head->value,1);
-		else if(streq(head->name,"Connection"))
-			setenv("HTTP_CONNECTION",head->value,1);
-	}
-
-	/* POpen CGI Script */
-	pfs = popen(getenv("SCRIPT_FILENAME"),"r");
-	if(!pfs) {
-		log("failed to POpen: %s", strerror(errno));
+	/* Start CGI Script with the environment of this request */
+	long  started = monotonic_ms();
+	pid_t pid     = cgi_spawn(r, &fd);
+	if (pid < 0) {
 		return handle_error(r,HTTP_STATUS_INTERNAL_SERVER_ERROR);
-	}	
-	
-	/* Copy data from popen to socket */
-	while (fgets(buffer,BUFSIZ,pfs) && strlen(buffer) > 0) {
-		fprintf(r->file, "%s", buffer);
 	}
 
-	/* Close popen, flush socket, return OK */
-	if (pclose(pfs) == -1) {
-		log("failed to pclose: %s", strerror(errno));
+	/* Relay script output to socket */
+	Body body = {0};
+	if (streq(r->method, "GET")) {
+		relay_cgi_conditional(r, fd, &body);
+	} else {
+		/* Scripts write their own headers, so the response length is unknown */
+		write_connection_headers(r, -1);
+		body_pipe(&body, fd);
 	}
-	fflush(r->file);
+	body_write(r, &body);
+
+	/* Close pipe, reap and account for the script, return OK */
+	close(fd);
+	cgi_account(r, pid, started, body.sent);
 	return HTTP_STATUS_OK;
 }
 
+/**
+ * Relay CGI output as a conditional response.
+ *
+ * @param	r	HTTP Request structure.
+ * @param	fd	Read end of CGI script output pipe.
+ * @param	chain	Body to append the response body to.
+ *
+ * This buffers the script output (up to CGI_MAX_BUFFER bytes) while hashing
+ * its body, then tags the response with a weak ETag derived from the hash.
+ * If the client's If-None-Match already names that ETag, the body is
+ * discarded and 304 Not Modified is sent instead.  Since the whole response
+ * is buffered, its length is known and the connection may be kept alive.
+ *
+ * Output that does not fit in the buffer, or that is not a 200 OK response,
+ * is relayed unchanged: the buffered part from memory and the rest straight
+ * from the pipe.
+ **/
+void relay_cgi_conditional(Request *r, int fd, Body *chain) {
+	char   *output = NULL;
+	size_t  length = 0;
+	size_t  body   = 0;		/* Offset of body (0 until headers end) */
+	ssize_t nread;
+	uint64_t hash  = HASH_INIT;
+	bool    more   = true;
+
+	/* Buffer output and hash the body as it arrives */
+	while (length <= CGI_MAX_BUFFER) {
+		char *grown = realloc(output, length + BUFSIZ + 1);
+		if (!grown) {
+			log("Unable to realloc: %s", strerror(errno));
+			goto relay;
+		}
+		output = grown;
+
+		nread = read(fd, output + length, BUFSIZ);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread <= 0) {
+			more = false;
+			break;
+		}
+		size_t start = length;
+		length += nread;
+		output[length] = 0;
+
+		if (!body) {
+			char *end = strstr(output + (start > 3 ? start - 3 : 0), "\n\r\n");
+			char *alt = strstr(output + (start > 1 ? start - 1 : 0), "\n\n");
+			if (end && (!alt || end < alt)) {
+				body = end - output + 3;
+			} else if (alt) {
+				body = alt - output + 2;
+			} else {
+				continue;
+			}
+			start = body;
+		}
+		hash = hash_bytes(output + start, length - start, hash);
+	}
+	if (more) {
+		goto relay;
+	}
+
+	/* Only tag complete 200 OK responses */
+	char *eol = body ? memchr(output, '\n', body) : NULL;
+	if (!eol || strncmp(output, "HTTP/", 5) || !memmem(output, eol - output, " 200", 4)) {
+		goto relay;
+	}
+
+	char etag[32];
+	snprintf(etag, sizeof(etag), "W/\"%016lx\"", (unsigned long)hash);
+
+	const char *match = request_header(r, "If-None-Match");
+	if (match && (strstr(match, etag) || streq(match, "*"))) {
+		debug("CGI output unchanged: %s", etag);
+		fprintf(r->file, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_NOT_MODIFIED));
+		fprintf(r->file, "ETag: %s\r\n", etag);
+		r->flags |= REQUEST_DELIMITED;	/* 304 never has a body */
+		fputs(r->flags & REQUEST_KEEPALIVE ? "Connection: keep-alive\r\n" : "Connection: close\r\n", r->file);
+		fputs("\r\n", r->file);
+		free(output);
+		return;
+	}
+
+	/* Copy script headers, replacing its framing with our own */
+	char *line = output;
+	char *headers_end = output + body;
+	while (line < headers_end) {
+		char *next = memchr(line, '\n', headers_end - line);
+		next = next ? next + 1 : headers_end;
+		if (next - line <= 2 && (line[0] == '\r' || line[0] == '\n')) {
+			break;
+		}
+		if (strncasecmp(line, "Content-Length:", 15) && strncasecmp(line, "Connection:", 11)) {
+			fwrite(line, 1, next - line, r->file);
+		}
+		line = next;
+	}
+	fprintf(r->file, "ETag: %s\r\n", etag);
+	write_connection_headers(r, length - body);
+	fputs("\r\n", r->file);
+	body_memory(chain, output + body, length - body, output);
+	return;
+
+relay:
+	/* Fall back to relaying the output as is */
+	write_connection_headers(r, -1);
+	body_memory(chain, output, length, output);
+	if (more) {
+		body_pipe(chain, fd);
+	}
+}
+
 /**
  * Handle displaying error page
  *
@@ -275,48 +518,76 @@ Status 	handle_cgi_request(Request *r) {
  * @return	Status of the HTTP error request.
  *
  * This writes an HTTP status error code and then generates an HTML message to
- * notify the user of the error.
+ * notify the user of the error.  Bodies prebuilt at startup are used when
+ * available.
  **/
 Status handle_error(Request *r, Status status) {
 	const char *status_string = http_status_string(status);
-	FILE *fs;
 	char buffer[BUFSIZ];
-	size_t nread;
+	size_t length;
+	struct stat sb;
+	Body body = {0};
 
 	log("HTTP error: %s", status_string);
 
-	/* Write HTTP Header */
-	fprintf(r->file, "HTTP/1.0 %s\n", status_string);
-	fprintf(r->file, "Content-type: text/html\r\n\r\n");
-
-	if (status == HTTP_STATUS_NOT_FOUND) {
+	const char *prebuilt = warm_error(status, &length);
+	if (prebuilt) {
+		body_memory(&body, prebuilt, length, NULL);
+	} else if (status == HTTP_STATUS_NOT_FOUND) {
 		/* Open 404 file for reading */
-		fs = fopen("www/html/404.html", "r");
-		if (!fs) {
-			log("Unable to fopen: %s",strerror(errno));
-			return status;
-		}
-
-		/* Read from file and write to socket in chunks */
-		while ((nread = fread(buffer,1,BUFSIZ,fs)) > 0) {
-			debug("nread = %d", (int)nread);
-			if (fwrite(buffer, 1, nread, r->file) <= 0) {
-				log("fwrite error");
-			}
+		int fd = open("www/html/404.html", O_RDONLY);
+		if (fd < 0) {
+			log("Unable to open: %s",strerror(errno));
+		} else if (fstat(fd, &sb) < 0) {
+			log("Unable to fstat: %s",strerror(errno));
+			close(fd);
+		} else {
+			body_file(&body, fd, 0, sb.st_size, SEGMENT_CLOSE);
 		}
+	}
 
-		if (fclose(fs) != 0) {
-			log("Unable to fclose: %s", strerror(errno));
-		}
-	} else {
+	if (!body.head) {
 		/* Write HTML Description of Error */
-		fprintf(r->file, "<!DOCTYPE html>\n");
-		fprintf(r->file, "<html>\n");
-		fprintf(r->file, "  <body><h1>%s</h1></body>\n",status_string);
-		fprintf(r->file, "</html>\n");
+		int n = snprintf(buffer, BUFSIZ,
+			"<!DOCTYPE html>\n"
+			"<html>\n"
+			"  <body><h1>%s</h1></body>\n"
+			"</html>\n", status_string);
+		body_memory(&body, buffer, n, NULL);
 	}
 
+	/* Write HTTP Header and body */
+	fprintf(r->file, "HTTP/1.0 %s\r\n", status_string);
+	fprintf(r->file, "Content-type: text/html\r\n");
+	write_connection_headers(r, body_length(&body));
+	fputs("\r\n", r->file);
+	body_write(r, &body);
+
 	return status;
 }
 
+/**
+ * Write connection management headers.
+ *
+ * @param	r	HTTP Request structure.
+ * @param	length	Length of the response body or -1 if unknown.
+ *
+ * A persistent connection needs a delimited body, so responses of unknown
+ * length always close the connection afterwards.
+ **/
+void write_connection_headers(Request *r, off_t length) {
+	if (length < 0) {
+		r->flags &= ~(REQUEST_KEEPALIVE | REQUEST_DELIMITED);
+		return;
+	}
+
+	r->flags |= REQUEST_DELIMITED;
+	fprintf(r->file, "Content-Length: %lld\r\n", (long long)length);
+	if (r->flags & REQUEST_KEEPALIVE) {
+		fputs("Connection: keep-alive\r\n", r->file);
+	} else {
+		fputs("Connection: close\r\n", r->file);
+	}
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c */
@@ -0,0 +1,372 @@
+/* heavy.c: Heavy-Hitter Tracking of URIs and Clients */
+
+#include "main.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define HEAVY_SLOTS	16		/* Independent sketches (one per writer at a time) */
+#define HEAVY_K		32		/* Space-Saving counters per slot and dimension */
+#define HEAVY_KEY	96		/* Longest key tracked (longer keys are truncated) */
+#define HEAVY_TOP	10		/* Heavy hitters reported per dimension */
+#define CMS_DEPTH	4		/* Count-Min rows */
+#define CMS_WIDTH	1024		/* Count-Min counters per row */
+#define HLL_BITS	12		/* HyperLogLog index bits */
+#define HLL_REGISTERS	(1 << HLL_BITS)
+#define HEAVY_WAIT	100		/* Yields a reader waits for a busy slot */
+
+/**
+ * Dimensions tracked
+ */
+typedef enum {
+	HEAVY_URI = 0,		/**< Request URIs */
+	HEAVY_CLIENT,		/**< Client addresses */
+	HEAVY_NOT_FOUND,	/**< URIs answered with 404 */
+	NHEAVY,
+} Dimension;
+
+static const char *DimensionNames[NHEAVY][2] = {
+	{"heavy_uri_requests", "uri"},
+	{"heavy_client_requests", "client"},
+	{"heavy_not_found_requests", "uri"},
+};
+
+/**
+ * Space-Saving counter
+ */
+typedef struct {
+	unsigned int	count;			/*< Estimated count (0 if unused) */
+	unsigned int	error;			/*< Largest possible overestimate */
+	char		key[HEAVY_KEY];		/*< Item */
+} Counter;
+
+/**
+ * Sketches of one dimension
+ */
+typedef struct {
+	Counter		top[HEAVY_K];			/*< Space-Saving candidates */
+	unsigned int	cms[CMS_DEPTH][CMS_WIDTH];	/*< Count-Min sketch of all items */
+} Sketch;
+
+/**
+ * Everything one writer updates
+ */
+typedef struct {
+	int		lock;				/*< Pid of the process using the slot (0 if none) */
+	Sketch		sketches[NHEAVY];		/*< One per dimension */
+	unsigned char	hll[HLL_REGISTERS];		/*< HyperLogLog of client addresses */
+} Slot;
+
+/* Global Variables */
+
+static Slot *Slots = NULL;		/* Shared by all workers */
+
+/**
+ * Allocate the shared sketches.
+ *
+ * @return	-1 on error and 0 on success.
+ **/
+int heavy_init(void) {
+	Slots = mmap(NULL, HEAVY_SLOTS * sizeof(Slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (Slots == MAP_FAILED) {
+		log("Unable to mmap: %s", strerror(errno));
+		Slots = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Hash a key with well mixed bits.
+ *
+ * @param	key	Item.
+ * @return	64-bit hash.
+ *
+ * FNV-1a is finished with the SplitMix64 mixer, since HyperLogLog and the
+ * Count-Min rows rely on every bit being uniform.
+ **/
+static uint64_t heavy_hash(const char *key) {
+	uint64_t h = hash_bytes(key, strlen(key), HASH_INIT);
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9UL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebUL;
+	h ^= h >> 31;
+	return h;
+}
+
+/**
+ * Determine the Count-Min counter of a key in one row.
+ **/
+static size_t cms_index(uint64_t hash, int row) {
+	uint32_t h1 = hash;
+	uint32_t h2 = hash >> 32;
+	return (h1 + (uint32_t)row * h2) % CMS_WIDTH;
+}
+
+/**
+ * Estimate the count of a key from a Count-Min sketch.
+ **/
+static unsigned int cms_estimate(unsigned int cms[CMS_DEPTH][CMS_WIDTH], uint64_t hash) {
+	unsigned int estimate = UINT32_MAX;
+	for (int row = 0; row < CMS_DEPTH; row++) {
+		unsigned int c = cms[row][cms_index(hash, row)];
+		estimate = c < estimate ? c : estimate;
+	}
+	return estimate;
+}
+
+/**
+ * Count one occurrence of a key.
+ *
+ * @param	s	Sketch of the key's dimension (in a locked slot).
+ * @param	key	Item.
+ *
+ * The Count-Min sketch counts every key.  The Space-Saving table keeps the
+ * HEAVY_K candidates: a key not in it replaces the smallest counter and
+ * inherits that count as its possible error.  Keys are truncated before
+ * anything else, so the sketch counts exactly the key the reader looks up.
+ **/
+static void heavy_count(Sketch *s, const char *key) {
+	char truncated[HEAVY_KEY];
+	snprintf(truncated, sizeof(truncated), "%s", key);
+
+	uint64_t hash = heavy_hash(truncated);
+	for (int row = 0; row < CMS_DEPTH; row++) {
+		s->cms[row][cms_index(hash, row)]++;
+	}
+
+	Counter *least = &s->top[0];
+	for (int i = 0; i < HEAVY_K; i++) {
+		Counter *c = &s->top[i];
+		if (c->count && streq(c->key, truncated)) {
+			c->count++;
+			return;
+		}
+		if (c->count < least->count) {
+			least = c;
+		}
+	}
+	least->error = least->count;
+	least->count++;
+	memcpy(least->key, truncated, sizeof(truncated));
+}
+
+/**
+ * Add a client address to the HyperLogLog.
+ *
+ * @param	hll	Registers (in a locked slot).
+ * @param	key	Client address.
+ **/
+static void heavy_hll_add(unsigned char *hll, const char *key) {
+	uint64_t hash = heavy_hash(key);
+	size_t   i    = hash >> (64 - HLL_BITS);
+	uint64_t rest = hash << HLL_BITS;
+	unsigned char rank = rest ? __builtin_clzll(rest) + 1 : 64 - HLL_BITS + 1;
+	if (rank > hll[i]) {
+		hll[i] = rank;
+	}
+}
+
+/**
+ * Record a completed request.
+ *
+ * @param	r	HTTP Request structure.
+ * @param	status	Status of the request.
+ *
+ * Each writer takes whichever slot is free, starting from one picked by its
+ * pid, so workers never wait on each other; if every slot is busy the
+ * request simply goes uncounted.
+ **/
+void heavy_record(Request *r, Status status) {
+	if (!Slots || !r->uri) {
+		return;
+	}
+
+	Slot *slot = NULL;
+	pid_t self = getpid();
+	for (int i = 0; i < HEAVY_SLOTS && !slot; i++) {
+		Slot *s = &Slots[(self + i) % HEAVY_SLOTS];
+		int unlocked = 0;
+		if (__atomic_compare_exchange_n(&s->lock, &unlocked, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			slot = s;
+		}
+	}
+	if (!slot) {
+		return;
+	}
+
+	heavy_count(&slot->sketches[HEAVY_URI], r->uri);
+	heavy_count(&slot->sketches[HEAVY_CLIENT], r->peer->host);
+	if (status == HTTP_STATUS_NOT_FOUND) {
+		heavy_count(&slot->sketches[HEAVY_NOT_FOUND], r->uri);
+	}
+	heavy_hll_add(slot->hll, r->peer->host);
+
+	__atomic_store_n(&slot->lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Estimate cardinality from HyperLogLog registers.
+ *
+ * @param	hll	Registers.
+ * @return	Estimated number of distinct items.
+ **/
+static double heavy_hll_estimate(const unsigned char *hll) {
+	double m     = HLL_REGISTERS;
+	double sum   = 0;
+	int    zeros = 0;
+
+	for (int i = 0; i < HLL_REGISTERS; i++) {
+		sum   += 1.0 / (1UL << hll[i]);
+		zeros += hll[i] == 0;
+	}
+	double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+	/* Linear counting is more accurate while registers are still empty
+	 * (the builtin, since log is our logging macro) */
+	if (estimate <= 2.5 * m && zeros) {
+		estimate = m * __builtin_log(m / zeros);
+	}
+	return estimate;
+}
+
+/**
+ * Write a label value, escaping it for the text exposition format.
+ **/
+static void heavy_label(FILE *fs, const char *s) {
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			fputc('\\', fs);
+			fputc(*s, fs);
+		} else if (*s == '\n') {
+			fputs("\\n", fs);
+		} else {
+			fputc(*s, fs);
+		}
+	}
+}
+
+/**
+ * Lock a slot for reading.
+ *
+ * @param	slot	Slot to lock.
+ * @return	true if locked, false if the slot stayed busy.
+ *
+ * Writers hold a slot only briefly, so the reader yields to them for a
+ * while.  A slot still held by a worker that died while writing is taken
+ * over; one that stays busy longer than HEAVY_WAIT yields is left out.
+ **/
+static bool heavy_read_lock(Slot *slot) {
+	pid_t self = getpid();
+	for (int i = 0; i < HEAVY_WAIT; i++) {
+		int holder = 0;
+		if (__atomic_compare_exchange_n(&slot->lock, &holder, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return true;
+		}
+		if (kill(holder, 0) < 0 && errno == ESRCH &&
+		    __atomic_compare_exchange_n(&slot->lock, &holder, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			log("Reclaiming heavy-hitter slot held by exited worker %d", holder);
+			return true;
+		}
+		sched_yield();
+	}
+	return false;
+}
+
+/**
+ * Merged view of one dimension
+ */
+typedef struct {
+	unsigned int	cms[CMS_DEPTH][CMS_WIDTH];	/*< Sum of every slot's sketch */
+	Counter		candidates[HEAVY_SLOTS * HEAVY_K];
+	size_t		ncandidates;
+} Merged;
+
+/**
+ * Compare merged candidates by count (largest first).
+ **/
+static int heavy_compare(const void *a, const void *b) {
+	const Counter *x = a;
+	const Counter *y = b;
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+/**
+ * Write heavy hitters and unique clients in text exposition format.
+ *
+ * @param	fs	Stream to write to.
+ *
+ * Slots are merged on read: Count-Min sketches add up, the union of all
+ * Space-Saving candidates is ranked by the merged sketch (which can only
+ * overestimate), and HyperLogLog registers merge by maximum.  A slot that
+ * cannot be locked is skipped, so the estimates can come out low.
+ **/
+void write_heavy_metrics(FILE *fs) {
+	unsigned char hll[HLL_REGISTERS] = {0};
+	Merged *merged = Slots ? calloc(1, sizeof(Merged)) : NULL;
+	if (!merged) {
+		return;
+	}
+
+	for (Dimension d = 0; d < NHEAVY; d++) {
+		memset(merged, 0, sizeof(Merged));
+
+		for (int i = 0; i < HEAVY_SLOTS; i++) {
+			Slot *slot = &Slots[i];
+			if (!heavy_read_lock(slot)) {
+				continue;
+			}
+			Sketch *s = &slot->sketches[d];
+			for (int row = 0; row < CMS_DEPTH; row++) {
+				for (int col = 0; col < CMS_WIDTH; col++) {
+					merged->cms[row][col] += s->cms[row][col];
+				}
+			}
+			for (int k = 0; k < HEAVY_K; k++) {
+				if (s->top[k].count) {
+					merged->candidates[merged->ncandidates++] = s->top[k];
+				}
+			}
+			if (d == HEAVY_CLIENT) {
+				for (int j = 0; j < HLL_REGISTERS; j++) {
+					hll[j] = slot->hll[j] > hll[j] ? slot->hll[j] : hll[j];
+				}
+			}
+			__atomic_store_n(&slot->lock, 0, __ATOMIC_RELEASE);
+		}
+
+		/* Rank each distinct candidate once by its merged estimate */
+		size_t n = 0;
+		for (size_t i = 0; i < merged->ncandidates; i++) {
+			Counter *c = &merged->candidates[i];
+			bool seen = false;
+			for (size_t j = 0; j < n && !seen; j++) {
+				seen = streq(merged->candidates[j].key, c->key);
+			}
+			if (!seen) {
+				merged->candidates[n] = *c;
+				merged->candidates[n].count = cms_estimate(merged->cms, heavy_hash(c->key));
+				n++;
+			}
+		}
+		qsort(merged->candidates, n, sizeof(Counter), heavy_compare);
+
+		for (size_t i = 0; i < n && i < HEAVY_TOP; i++) {
+			fprintf(fs, "%s{%s=\"", DimensionNames[d][0], DimensionNames[d][1]);
+			heavy_label(fs, merged->candidates[i].key);
+			fprintf(fs, "\"} %u\n", merged->candidates[i].count);
+		}
+	}
+
+	fprintf(fs, "unique_clients_estimate %.0f\n", heavy_hll_estimate(hll));
+	free(merged);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
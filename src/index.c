@@ -0,0 +1,94 @@
+/* index.c: Directory Index Resolution */
+
+#include "main.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define INDEX_CACHE_SLOTS	64
+
+/**
+ * Cached index decision for one directory.
+ *
+ * The decision is valid as long as the directory's mtime is unchanged, which
+ * covers the index file being created, removed, or renamed.
+ */
+typedef struct {
+	char		*dir;		/*< Real path of directory (NULL if unused) */
+	struct timespec	mtime;		/*< Directory mtime when decision was made */
+	char		*index;		/*< Path of index file or NULL to browse */
+} IndexEntry;
+
+static IndexEntry IndexCache[INDEX_CACHE_SLOTS];
+
+/**
+ * Hash directory path into an index cache slot.
+ *
+ * @param	s	Directory path.
+ * @return	Slot number in IndexCache.
+ **/
+static size_t index_slot(const char *s) {
+	unsigned long hash = 5381;
+	while (*s) {
+		hash = ((hash << 5) + hash) + (unsigned char)*s++;
+	}
+	return hash % INDEX_CACHE_SLOTS;
+}
+
+/**
+ * Determine index file for a directory.
+ *
+ * @param	dir	Real path of directory.
+ * @param	sb	Stat information of directory.
+ * @return	An allocated string containing the path of the index file, or
+ * NULL if the directory has no index file and should be browsed instead.
+ *
+ * The decision is cached per directory and revalidated against the
+ * directory mtime (from the stat the caller already made), so repeated hits
+ * on a landing page skip the access check (or a full scandir listing).  The
+ * caller still stats the index file itself, so a hit costs two stats in all.
+ *
+ * The cache is process-local.  In forking mode each child starts with the
+ * parent's copy, so hits there depend on warm_init resolving the decisions
+ * for the document tree before the server forks; directories it did not
+ * visit are resolved again in every child.
+ *
+ * The returned string must later be freed.
+ **/
+char * determine_index_path(const char *dir, const struct stat *sb) {
+	if (!IndexFile || !IndexFile[0]) {
+		return NULL;
+	}
+
+	IndexEntry *e = &IndexCache[index_slot(dir)];
+	if (e->dir && streq(e->dir, dir) &&
+	    e->mtime.tv_sec == sb->st_mtim.tv_sec && e->mtime.tv_nsec == sb->st_mtim.tv_nsec) {
+		debug("Index cache hit for %s", dir);
+		return e->index ? strdup(e->index) : NULL;
+	}
+
+	/* Resolve decision and replace whatever occupied the slot */
+	char path[BUFSIZ];
+	const char *separator = (dir[strlen(dir) - 1] == '/') ? "" : "/";
+	snprintf(path, BUFSIZ, "%s%s%s", dir, separator, IndexFile);
+
+	free(e->dir);
+	free(e->index);
+	e->dir   = strdup(dir);
+	e->mtime = sb->st_mtim;
+	e->index = (access(path, R_OK) == 0) ? strdup(path) : NULL;
+	if (!e->dir) {
+		free(e->index);
+		e->index = NULL;
+	}
+
+	debug("Index cache miss for %s: %s", dir, e->index ? e->index : "browse");
+	return e->index ? strdup(e->index) : NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
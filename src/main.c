@@ -3,6 +3,7 @@
 #include "main.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
@@ -13,6 +14,10 @@ char *Port		= "9898";
 char *MimeTypesPath	= "/etc/mime.types";
 char *DefaultMimeType	= "text/plain";
 char *RootPath		= "www";
+char *IndexFile		= "index.html";
+int   KeepAliveTimeout	= 5;
+int   MaxRequests	= 128;
+char *CachePolicyPath	= NULL;
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,14 +26,26 @@ char *RootPath		= "www";
  * @param	status		Exit status.
  */
 void usage(const char *progname, int status) {
-	fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+	fprintf(stderr, "Usage: %s [hcCDiklmMnpPrRsSwW]\n", progname);
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "	-h		Display help message\n");
-	fprintf(stderr, "	-c mode		Single or Forking mode\n");
+	fprintf(stderr, "	-c mode		Single, Forking, Preforked, or Dispatch mode\n");
+	fprintf(stderr, "	-C path		Path to cache policy rules\n");
+	fprintf(stderr, "	-D h:s:b:c	Dispatch workers for health, static, browse, and CGI\n");
+	fprintf(stderr, "	-i name		Directory index file (empty to always browse)\n");
+	fprintf(stderr, "	-k seconds	Keep-alive idle timeout (0 to disable)\n");
+	fprintf(stderr, "	-l ms		Log requests and CGI scripts slower than ms (0 to disable)\n");
 	fprintf(stderr, "	-m path		Path to mimetypes file\n");
 	fprintf(stderr, "	-M mimetype	Default mimetype\n");
+	fprintf(stderr, "	-n requests	Maximum concurrent requests\n");
 	fprintf(stderr, "	-p port		Port to listen on\n");
+	fprintf(stderr, "	-P members	Share cache with host:port,... (including this one)\n");
 	fprintf(stderr, "	-M path 	Root directory\n");
+	fprintf(stderr, "	-R target	Mirror requests to host:port or unix:path\n");
+	fprintf(stderr, "	-s path		Hot set snapshot file (saved on shutdown)\n");
+	fprintf(stderr, "	-S percent	Percentage of requests to mirror\n");
+	fprintf(stderr, "	-w min:max	Minimum and maximum preforked workers\n");
+	fprintf(stderr, "	-W ms		Log dispatch loop stalls longer than ms (0 to disable)\n");
 	exit(status);
 }
 
@@ -40,8 +57,10 @@ void usage(const char *progname, int status) {
  * @param	mode	Pointer to ServerMode variable.
  * @return true if parsing was succesful, false if there was an error.
  *
- * This should set the mode, MimeTypePath, DefaultMimeType, Port, and RootPath
- * if specified.
+ * This should set the mode, MimeTypePath, DefaultMimeType, Port, RootPath,
+ * IndexFile, KeepAliveTimeout, MaxRequests, CachePolicyPath, MirrorTarget,
+ * MirrorPercent, MinWorkers, MaxWorkers, DispatchWorkers, SnapshotPath,
+ * ClusterMembers, SlowThreshold, and StallThreshold if specified.
  */
 bool parse_options(int argc, char *argv[], ServerMode *mode) {
 	int argind = 1;
@@ -53,26 +72,75 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
 					*mode = SINGLE;
 				} else if (streq(argv[argind], "forking")) {
 					*mode = FORKING;
+				} else if (streq(argv[argind], "preforked")) {
+					*mode = PREFORKED;
+				} else if (streq(argv[argind], "dispatch")) {
+					*mode = DISPATCH;
 				} else {
 					return false;
 				}
 				argind++;
 				break;
+			case 'C':
+				CachePolicyPath = argv[argind++];
+				break;
 			case 'h':
 				usage(argv[0], EXIT_SUCCESS);
 				break;
+			case 'i':
+				IndexFile = argv[argind++];
+				break;
+			case 'k':
+				KeepAliveTimeout = atoi(argv[argind++]);
+				break;
+			case 'l':
+				SlowThreshold = atoi(argv[argind++]);
+				break;
 			case 'm':
 				MimeTypesPath =argv[argind++];
 				break;
 			case 'M':
 				DefaultMimeType = argv[argind++];
 				break;
+			case 'n':
+				MaxRequests = atoi(argv[argind++]);
+				break;
 			case 'p':
 				Port = argv[argind++];
 				break;
 			case 'r':
 				RootPath = argv[argind++];
 				break;
+			case 'P':
+				ClusterMembers = argv[argind++];
+				break;
+			case 'R':
+				MirrorTarget = argv[argind++];
+				break;
+			case 's':
+				SnapshotPath = argv[argind++];
+				break;
+			case 'S':
+				MirrorPercent = atoi(argv[argind++]);
+				break;
+			case 'D':
+				if (sscanf(argv[argind++], "%d:%d:%d:%d", &DispatchWorkers[PRIORITY_HEALTH],
+				    &DispatchWorkers[PRIORITY_STATIC], &DispatchWorkers[PRIORITY_BROWSE],
+				    &DispatchWorkers[PRIORITY_CGI]) != 4 || DispatchWorkers[PRIORITY_STATIC] < 1 ||
+				    DispatchWorkers[PRIORITY_HEALTH] + DispatchWorkers[PRIORITY_STATIC] +
+				    DispatchWorkers[PRIORITY_BROWSE] + DispatchWorkers[PRIORITY_CGI] > MAX_WORKERS) {
+					return false;
+				}
+				break;
+			case 'w':
+				if (sscanf(argv[argind++], "%d:%d", &MinWorkers, &MaxWorkers) != 2 ||
+				    MinWorkers < 1 || MaxWorkers < MinWorkers || MaxWorkers > MAX_WORKERS) {
+					return false;
+				}
+				break;
+			case 'W':
+				StallThreshold = atoi(argv[argind++]);
+				break;
 			default:
 				return false;
 				break;
@@ -94,6 +162,74 @@ int main(int argc, char *argv[]) {
 		usage(argv[0],EXIT_FAILURE);
 	}
 
+	/* A single server cannot afford to wait on idle connections */
+	if (mode == SINGLE) {
+		KeepAliveTimeout = 0;
+	}
+
+	/* Writes to clients that hung up should fail, not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Allocate metrics shared by all workers */
+	if (metrics_init() < 0) {
+		fprintf(stderr, "metrics_init failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Compile cache policy rules */
+	if (policy_load(CachePolicyPath) < 0) {
+		fprintf(stderr, "policy_load failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Start mirror process before the server socket exists */
+	if (mirror_init() < 0) {
+		fprintf(stderr, "mirror_init failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Allocate the CGI accounting table shared by all workers */
+	if (cgi_init() < 0) {
+		fprintf(stderr, "cgi_init failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Allocate the heavy-hitter sketches shared by all workers */
+	if (heavy_init() < 0) {
+		fprintf(stderr, "heavy_init failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Allocate the file popularity counters shared by all workers */
+	if (cache_init() < 0) {
+		fprintf(stderr, "cache_init failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Allocate the recent metrics rings shared by all workers */
+	if (series_init() < 0) {
+		fprintf(stderr, "series_init failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Allocate the dependency table shared by all workers */
+	if (prefetch_init() < 0) {
+		fprintf(stderr, "prefetch_init failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Allocate the load sample shared by all workers */
+	if (compress_init() < 0) {
+		fprintf(stderr, "compress_init failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Build the cache cluster ring */
+	if (cluster_init() < 0) {
+		fprintf(stderr, "cluster_init failed\n");
+		return EXIT_FAILURE;
+	}
+
 	/* listen to server socket */
 	int socket_fd = socket_listen(Port);
 	if (socket_fd < 0) {
@@ -105,16 +241,38 @@ int main(int argc, char *argv[]) {
 	char root_path_buffer[BUFSIZ];
 	RootPath = realpath(RootPath, root_path_buffer);
 
+	/* Restore the previous process's hot set before warming up */
+	if (snapshot_init() < 0) {
+		fprintf(stderr, "snapshot_init failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Build read-only caches once so every worker shares their pages */
+	if (warm_init() < 0) {
+		fprintf(stderr, "warm_init failed\n");
+		return EXIT_FAILURE;
+	}
+
 	log("Listening on port %s", Port);
 	debug("RootPath 	= %s", RootPath);
 	debug("MimeTypePath 	= %s", MimeTypesPath);
 	debug("DefaultMimeType 	= %s", DefaultMimeType);
-	debug("ConcurrencyMode 	= %s", mode == SINGLE ? "Single" : "Forking");
+	debug("IndexFile 	= %s", IndexFile);
+	debug("KeepAliveTimeout 	= %d", KeepAliveTimeout);
+	debug("MaxRequests 	= %d", MaxRequests);
+	debug("CachePolicyPath 	= %s", CachePolicyPath ? CachePolicyPath : "(built-in)");
+	debug("ConcurrencyMode 	= %s", mode == SINGLE ? "Single" : mode == FORKING ? "Forking" :
+		mode == PREFORKED ? "Preforked" : "Dispatch");
 
 	if (mode == SINGLE) {
 		single_server(socket_fd);
-	} else {
+	} else if (mode == FORKING) {
 		forking_server(socket_fd);
+	} else if (mode == PREFORKED) {
+		debug("Workers 	= %d:%d", MinWorkers, MaxWorkers);
+		preforked_server(socket_fd);
+	} else {
+		dispatch_server(socket_fd);
 	}
 	return status;
 }
@@ -0,0 +1,411 @@
+/* metrics.c: Shared Server Metrics */
+
+#include "main.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+/* Global Variables */
+
+Metrics *Stats         = NULL;
+Worker  *CurrentWorker = NULL;		/* Scoreboard slot of this process (if any) */
+
+/* Histogram bucket bounds */
+
+static const unsigned long TimeBounds[HISTOGRAM_BUCKETS] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000,
+};
+static const unsigned long SegmentBounds[HISTOGRAM_BUCKETS] = {
+	1, 2, 4, 8, 10, 16, 32, 64, 128, 256, 512, 1024,
+};
+
+/**
+ * Allocate shared metrics.
+ *
+ * @return	-1 on error and 0 on success.
+ *
+ * The metrics live in an anonymous shared mapping created before any worker
+ * is forked, so every process updates (with atomics) the same counters.
+ **/
+int metrics_init(void) {
+	Stats = mmap(NULL, sizeof(Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (Stats == MAP_FAILED) {
+		log("Unable to mmap: %s", strerror(errno));
+		Stats = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Claim a free worker scoreboard slot.
+ *
+ * @return	Slot (marked idle) or NULL if the scoreboard is full.
+ **/
+Worker * metrics_worker(void) {
+	for (int i = 0; i < MAX_WORKERS; i++) {
+		Worker *w = &Stats->workers[i];
+		if (w->state == WORKER_FREE) {
+			w->state  = WORKER_IDLE;
+			w->retire = false;
+			memset(w->admitted, 0, sizeof(w->admitted));
+			w->connections = 0;
+			return w;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Free the scoreboard slot of an exited worker.
+ *
+ * @param	pid	Process id of the worker.
+ * @return	Freed slot or NULL if the pid had none.
+ *
+ * A worker killed in the middle of a request never released the admission
+ * capacity it held, nor counted its connection as closed, so both are
+ * released here on its behalf; otherwise every crash would shrink the
+ * server's capacity (and inflate its open connections) for good.
+ **/
+Worker * metrics_reap(pid_t pid) {
+	for (int i = 0; i < MAX_WORKERS; i++) {
+		Worker *w = &Stats->workers[i];
+		if (w->state == WORKER_FREE || w->pid != pid) {
+			continue;
+		}
+
+		for (Priority p = 0; p < NPRIORITIES; p++) {
+			if (w->admitted[p]) {
+				log("Releasing %u %s requests held by worker %d", w->admitted[p], priority_string(p), pid);
+				__atomic_sub_fetch(&Stats->active[p], w->admitted[p], __ATOMIC_RELAXED);
+				__atomic_sub_fetch(&Stats->total, w->admitted[p], __ATOMIC_RELAXED);
+				w->admitted[p] = 0;
+			}
+		}
+		if (w->connections) {
+			__atomic_sub_fetch(&Stats->connections, w->connections, __ATOMIC_RELAXED);
+			w->connections = 0;
+		}
+		w->pid   = 0;
+		w->state = WORKER_FREE;
+		return w;
+	}
+	return NULL;
+}
+
+/**
+ * Count a client connection being opened or closed for good.
+ *
+ * @param	delta	1 when a connection is accepted, -1 when it is closed.
+ *
+ * The connection is also counted against the worker closing it (if any),
+ * so it can be counted as closed when that worker dies.
+ **/
+void metrics_connection(int delta) {
+	unsigned int open = __atomic_add_fetch(&Stats->connections, delta, __ATOMIC_RELAXED);
+	metrics_adopt(delta);
+	if (delta > 0) {
+		series_connections(open);
+	}
+}
+
+/**
+ * Take over (or hand back) an open connection accepted by another process.
+ *
+ * @param	delta	1 when taking a connection over, -1 when handing it back.
+ **/
+void metrics_adopt(int delta) {
+	if (CurrentWorker) {
+		__atomic_add_fetch(&CurrentWorker->connections, delta, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Add an observation to a histogram.
+ *
+ * @param	h	Histogram.
+ * @param	bounds	Upper bound of each bucket.
+ * @param	value	Observed value.
+ **/
+static void histogram_observe(Histogram *h, const unsigned long *bounds, unsigned long value) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (value <= bounds[i]) {
+			__atomic_add_fetch(&h->buckets[i], 1, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write a histogram in text exposition format.
+ *
+ * @param	fs	Stream to write to.
+ * @param	name	Metric name.
+ * @param	h	Histogram.
+ * @param	bounds	Upper bound of each bucket.
+ * @param	scale	Divisor turning observations into the metric's unit.
+ **/
+static void histogram_write(FILE *fs, const char *name, Histogram *h, const unsigned long *bounds, double scale) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		fprintf(fs, "%s_bucket{le=\"%g\"} %lu\n", name, bounds[i] / scale, __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED));
+	}
+	unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	fprintf(fs, "%s_bucket{le=\"+Inf\"} %lu\n", name, count);
+	fprintf(fs, "%s_sum %g\n", name, __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / scale);
+	fprintf(fs, "%s_count %lu\n", name, count);
+}
+
+/**
+ * Record a completed request.
+ *
+ * @param	r	HTTP Request structure.
+ * @param	started	When handling started (monotonic_ms), after the request
+ * was parsed.
+ * @param	status	Status of the request.
+ *
+ * Handling time measures the server alone, while TCP_INFO sampled on the
+ * client socket as the response completes describes the network and client:
+ * RTT and its variance, retransmits, the congestion window, and what is
+ * still in flight.  Both go into histograms, and requests slower than
+ * SlowThreshold are logged with all of it, so a slow request can be told to
+ * be slow on our side or on theirs.
+ **/
+void metrics_request(Request *r, long started, Status status) {
+	/* Fetches by cluster members are internal traffic (and mostly 404s) */
+	if (request_header(r, "X-Cluster-Fetch")) {
+		return;
+	}
+
+	long elapsed = monotonic_ms() - started;
+	histogram_observe(&Stats->handling, TimeBounds, elapsed * 1000);
+	heavy_record(r, status);
+	series_request(status, elapsed);
+
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if (getsockopt(r->fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+		return;
+	}
+
+	histogram_observe(&Stats->rtt, TimeBounds, info.tcpi_rtt);
+	histogram_observe(&Stats->rttvar, TimeBounds, info.tcpi_rttvar);
+	histogram_observe(&Stats->cwnd, SegmentBounds, info.tcpi_snd_cwnd);
+	histogram_observe(&Stats->unacked, SegmentBounds, info.tcpi_unacked);
+	if (info.tcpi_total_retrans > r->peer->retransmits) {
+		__atomic_add_fetch(&Stats->retransmits, info.tcpi_total_retrans - r->peer->retransmits, __ATOMIC_RELAXED);
+		r->peer->retransmits = info.tcpi_total_retrans;
+	}
+
+	if (SlowThreshold > 0 && elapsed >= SlowThreshold) {
+		log("SLOW %s %s from %s:%s: %ldms %s, rtt %.3fms rttvar %.3fms retrans %u cwnd %u unacked %u (%u bytes)",
+			r->method, r->uri, r->peer->host, r->peer->port, elapsed, http_status_string(status),
+			info.tcpi_rtt / 1000.0, info.tcpi_rttvar / 1000.0, info.tcpi_total_retrans,
+			info.tcpi_snd_cwnd, info.tcpi_unacked, info.tcpi_unacked * info.tcpi_snd_mss);
+	}
+}
+
+/**
+ * Count TCP sockets in TIME_WAIT on this host.
+ *
+ * @return	Number of sockets or -1 if it cannot be determined.
+ **/
+static long metrics_time_wait(void) {
+	char line[BUFSIZ];
+	long tw = -1;
+	FILE *fs = fopen("/proc/net/sockstat", "r");
+	if (!fs) {
+		return -1;
+	}
+	while (fgets(line, BUFSIZ, fs)) {
+		char *s = strstr(line, " tw ");
+		if (strncmp(line, "TCP:", 4) == 0 && s) {
+			tw = atol(s + 4);
+			break;
+		}
+	}
+	fclose(fs);
+	return tw;
+}
+
+/**
+ * Read a TCP extension counter of the kernel.
+ *
+ * @param	name	Counter name in /proc/net/netstat (e.g. ListenOverflows).
+ * @return	Counter value or -1 if it is unavailable.
+ *
+ * The TcpExt section is a line of names followed by a line of values.
+ **/
+static long metrics_netstat(const char *name) {
+	char names[BUFSIZ];
+	char values[BUFSIZ];
+	long value = -1;
+	FILE *fs = fopen("/proc/net/netstat", "r");
+	if (!fs) {
+		return -1;
+	}
+	while (fgets(names, BUFSIZ, fs) && fgets(values, BUFSIZ, fs)) {
+		if (strncmp(names, "TcpExt:", 7) != 0) {
+			continue;
+		}
+		char *save;
+		char *v = values + 7;
+		for (char *token = strtok_r(names + 7, " \n", &save); token; token = strtok_r(NULL, " \n", &save)) {
+			long current = strtol(v, &v, 10);
+			if (streq(token, name)) {
+				value = current;
+				break;
+			}
+		}
+		break;
+	}
+	fclose(fs);
+	return value;
+}
+
+/**
+ * Sample the listen queue into the shared metrics.
+ *
+ * @param	sfd	Server socket file descriptor.
+ *
+ * This is for workers that do not hold the server socket themselves (those
+ * of the dispatch pools), so the process that does samples it for them.
+ **/
+void metrics_sample_listen(int sfd) {
+	unsigned int  queued  = 0;
+	unsigned int  backlog = 0;
+	unsigned long drops   = 0;
+
+	if (socket_queue(sfd, &queued, &backlog) == 0) {
+		__atomic_store_n(&Stats->listen_queued, queued, __ATOMIC_RELAXED);
+		__atomic_store_n(&Stats->listen_backlog, backlog, __ATOMIC_RELAXED);
+	}
+	if (socket_drops(sfd, &drops) == 0) {
+		__atomic_store_n(&Stats->listen_drops, drops, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Write listen queue metrics.
+ *
+ * @param	fs	Stream to write to.
+ *
+ * The queue depth and limit come from TCP_INFO on ServerSocket and its own
+ * drops from SO_MEMINFO (or from the last sample if this process does not
+ * hold the server socket); the kernel-wide ListenOverflows and ListenDrops
+ * also count other listeners but survive restarts of this server.
+ **/
+static void metrics_listen(FILE *fs) {
+	unsigned int  queued  = __atomic_load_n(&Stats->listen_queued, __ATOMIC_RELAXED);
+	unsigned int  backlog = __atomic_load_n(&Stats->listen_backlog, __ATOMIC_RELAXED);
+	unsigned long drops   = __atomic_load_n(&Stats->listen_drops, __ATOMIC_RELAXED);
+	bool sampled = ServerSocket < 0 && backlog > 0;
+
+	if (sampled || (ServerSocket >= 0 && socket_queue(ServerSocket, &queued, &backlog) == 0)) {
+		fprintf(fs, "listen_queue_length %u\n", queued);
+		fprintf(fs, "listen_queue_backlog %u\n", backlog);
+	}
+	if (sampled || (ServerSocket >= 0 && socket_drops(ServerSocket, &drops) == 0)) {
+		fprintf(fs, "listen_dropped_total %lu\n", drops);
+	}
+	long overflows = metrics_netstat("ListenOverflows");
+	if (overflows >= 0) {
+		fprintf(fs, "tcp_listen_overflows_total %ld\n", overflows);
+	}
+	long dropped = metrics_netstat("ListenDrops");
+	if (dropped >= 0) {
+		fprintf(fs, "tcp_listen_drops_total %ld\n", dropped);
+	}
+}
+
+/**
+ * Write metrics in text exposition format.
+ *
+ * @param	fs	Stream to write to.
+ **/
+void metrics_write(FILE *fs) {
+	for (Priority p = 0; p < NPRIORITIES; p++) {
+		const char *name = priority_string(p);
+		fprintf(fs, "requests_active{class=\"%s\"} %u\n", name, __atomic_load_n(&Stats->active[p], __ATOMIC_RELAXED));
+		fprintf(fs, "requests_total{class=\"%s\"} %lu\n", name, __atomic_load_n(&Stats->served[p], __ATOMIC_RELAXED));
+		fprintf(fs, "requests_rejected_total{class=\"%s\"} %lu\n", name, __atomic_load_n(&Stats->rejected[p], __ATOMIC_RELAXED));
+	}
+	fprintf(fs, "requests_capacity %d\n", MaxRequests);
+	fprintf(fs, "connections_open %u\n", __atomic_load_n(&Stats->connections, __ATOMIC_RELAXED));
+	unsigned int idle = 0;
+	unsigned int busy = 0;
+	for (int i = 0; i < MAX_WORKERS; i++) {
+		idle += Stats->workers[i].state == WORKER_IDLE;
+		busy += Stats->workers[i].state == WORKER_BUSY;
+	}
+	fprintf(fs, "workers{state=\"idle\"} %u\n", idle);
+	fprintf(fs, "workers{state=\"busy\"} %u\n", busy);
+	fprintf(fs, "mirror_requests_total %lu\n", __atomic_load_n(&Stats->mirrored, __ATOMIC_RELAXED));
+	fprintf(fs, "mirror_dropped_total %lu\n", __atomic_load_n(&Stats->mirror_dropped, __ATOMIC_RELAXED));
+	fprintf(fs, "connections_closed_total{by=\"client\"} %lu\n", __atomic_load_n(&Stats->closed_client, __ATOMIC_RELAXED));
+	fprintf(fs, "connections_closed_total{by=\"server\"} %lu\n", __atomic_load_n(&Stats->closed_server, __ATOMIC_RELAXED));
+	fprintf(fs, "connections_lingered_bytes_total %lu\n", __atomic_load_n(&Stats->lingered, __ATOMIC_RELAXED));
+	fprintf(fs, "cluster_fetches_total{result=\"hit\"} %lu\n", __atomic_load_n(&Stats->cluster_hits, __ATOMIC_RELAXED));
+	fprintf(fs, "cluster_fetches_total{result=\"miss\"} %lu\n", __atomic_load_n(&Stats->cluster_misses, __ATOMIC_RELAXED));
+	fprintf(fs, "prefetch_documents_total %lu\n", __atomic_load_n(&Stats->prefetched, __ATOMIC_RELAXED));
+	fprintf(fs, "compressed_responses_total %lu\n", __atomic_load_n(&Stats->compressed, __ATOMIC_RELAXED));
+	fprintf(fs, "compressed_cached_total %lu\n", __atomic_load_n(&Stats->compress_cached, __ATOMIC_RELAXED));
+	fprintf(fs, "compression_saved_bytes_total %lu\n", __atomic_load_n(&Stats->compress_saved, __ATOMIC_RELAXED));
+	long tw = metrics_time_wait();
+	if (tw >= 0) {
+		fprintf(fs, "tcp_time_wait %ld\n", tw);
+	}
+	metrics_listen(fs);
+	fprintf(fs, "tcp_retransmits_total %lu\n", __atomic_load_n(&Stats->retransmits, __ATOMIC_RELAXED));
+	fprintf(fs, "event_loop_stalls_total %lu\n", __atomic_load_n(&Stats->stalls, __ATOMIC_RELAXED));
+	histogram_write(fs, "request_handling_seconds", &Stats->handling, TimeBounds, 1e6);
+	histogram_write(fs, "tcp_rtt_seconds", &Stats->rtt, TimeBounds, 1e6);
+	histogram_write(fs, "tcp_rtt_variance_seconds", &Stats->rttvar, TimeBounds, 1e6);
+	histogram_write(fs, "tcp_cwnd_segments", &Stats->cwnd, SegmentBounds, 1);
+	histogram_write(fs, "tcp_unacked_segments", &Stats->unacked, SegmentBounds, 1);
+	write_cgi_metrics(fs);
+	write_heavy_metrics(fs);
+}
+
+/**
+ * Handle metrics request.
+ *
+ * @param	r	HTTP Request structure.
+ * @return	Status of the HTTP metrics request.
+ *
+ * With a "series" query (optionally "series=seconds") the recent per-second
+ * history is returned as JSON instead of the current totals.
+ **/
+Status handle_metrics_request(Request *r) {
+	const char *query = r->peer->query;
+	bool series = query && strncmp(query, "series", 6) == 0;
+	char  *body = NULL;
+	size_t size = 0;
+	FILE  *fs   = open_memstream(&body, &size);
+	if (!fs) {
+		log("Unable to open_memstream: %s", strerror(errno));
+		return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+	}
+	if (series) {
+		write_series(fs, query[6] == '=' ? atoi(query + 7) : 0);
+	} else {
+		metrics_write(fs);
+	}
+	fclose(fs);
+
+	Body chain = {0};
+	body_memory(&chain, body, size, body);
+	fprintf(r->file, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_OK));
+	fprintf(r->file, "Content-type: %s\r\n", series ? "application/json" : "text/plain");
+	write_connection_headers(r, body_length(&chain));
+	fputs("\r\n", r->file);
+	body_write(r, &chain);
+	return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
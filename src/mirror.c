@@ -0,0 +1,209 @@
+/* mirror.c: Request Mirroring to a Shadow Instance */
+
+#include "main.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define MIRROR_MAX	65536		/* Largest mirrored request */
+#define MIRROR_TIMEOUT	2		/* Seconds to wait on the shadow instance */
+
+/* Global Variables */
+
+char *MirrorTarget  = NULL;
+int   MirrorPercent = 100;
+
+static int MirrorFd = -1;		/* Write end of queue to mirror process */
+
+/**
+ * Connect to the shadow instance.
+ *
+ * @return	Connected socket file descriptor or -1 on error.
+ *
+ * MirrorTarget is either "unix:/path/to/socket" or "host:port".
+ **/
+static int mirror_connect(void) {
+	int fd = -1;
+
+	if (strncmp(MirrorTarget, "unix:", 5) == 0) {
+		struct sockaddr_un addr = {.sun_family = AF_UNIX};
+		strncpy(addr.sun_path, MirrorTarget + 5, sizeof(addr.sun_path) - 1);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+		    connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+		return fd;
+	}
+
+	char host[NI_MAXHOST];
+	const char *port = strrchr(MirrorTarget, ':');
+	if (!port) {
+		return -1;
+	}
+	snprintf(host, sizeof(host), "%.*s", (int)(port - MirrorTarget), MirrorTarget);
+
+	struct addrinfo hints = {
+		.ai_family	= AF_UNSPEC,
+		.ai_socktype	= SOCK_STREAM,
+	};
+	struct addrinfo *results;
+	if (getaddrinfo(host, port + 1, &hints, &results) != 0) {
+		return -1;
+	}
+	for (struct addrinfo *p = results; p != NULL && fd < 0; p = p->ai_next) {
+		if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+			continue;
+		}
+		if (connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(results);
+	return fd;
+}
+
+/**
+ * Replay queued requests against the shadow instance.
+ *
+ * @param	qfd	Read end of request queue.
+ *
+ * Each request is sent on its own connection and the response is read and
+ * discarded.  This runs in its own process and never returns.
+ **/
+static void mirror_loop(int qfd) {
+	static char request[MIRROR_MAX];
+	char buffer[BUFSIZ];
+	struct timeval timeout = {.tv_sec = MIRROR_TIMEOUT};
+
+	while (true) {
+		ssize_t n = recv(qfd, request, sizeof(request), 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			exit(EXIT_SUCCESS);
+		}
+
+		int fd = mirror_connect();
+		if (fd < 0) {
+			debug("Unable to connect to mirror %s", MirrorTarget);
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		if (send(fd, request, n, MSG_NOSIGNAL) == n) {
+			while (read(fd, buffer, BUFSIZ) > 0);
+		}
+		close(fd);
+	}
+}
+
+/**
+ * Start mirror process.
+ *
+ * @return	-1 on error and 0 on success.
+ *
+ * Requests are handed to the mirror process over a Unix datagram socket.  The
+ * socket's kernel queue is the bounded mirror queue: workers never block on
+ * it, and requests that do not fit are dropped, so a slow or dead shadow
+ * instance cannot add latency to the primary.
+ **/
+int mirror_init(void) {
+	int fds[2];
+
+	if (!MirrorTarget) {
+		return 0;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0) {
+		log("Unable to socketpair: %s", strerror(errno));
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		log("Unable to fork: %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		close(fds[1]);
+		mirror_loop(fds[0]);
+	}
+
+	close(fds[0]);
+	MirrorFd = fds[1];
+	log("Mirroring %d%% of requests to %s", MirrorPercent, MirrorTarget);
+	return 0;
+}
+
+/**
+ * Mirror a sample of requests.
+ *
+ * @param	r	Parsed HTTP Request structure.
+ *
+ * The request line and headers are reconstructed (with "Connection: close")
+ * and queued for the mirror process without blocking.  Requests with a body
+ * are not mirrored, since the body is never read.
+ **/
+void mirror_request(Request *r) {
+	static pid_t seeded = 0;
+	char request[MIRROR_MAX];
+	const char *length = request_header(r, "Content-Length");
+
+	if (MirrorFd < 0) {
+		return;
+	}
+
+	/* Forked workers inherit the same random state, so seed each one */
+	if (seeded != getpid()) {
+		seeded = getpid();
+		srandom(seeded ^ time(NULL));
+	}
+	if ((random() % 100) >= MirrorPercent) {
+		return;
+	}
+	if (request_header(r, "Transfer-Encoding") || (length && atol(length) > 0)) {
+		return;
+	}
+
+	int n = snprintf(request, sizeof(request), "%s %s%s%s HTTP/1.0\r\n",
+		r->method, r->uri, r->peer->query[0] ? "?" : "", r->peer->query);
+	for (unsigned int i = 0; i < r->nheaders && n < MIRROR_MAX; i++) {
+		if (strcasecmp(r->headers[i].name, "Connection") != 0) {
+			n += snprintf(request + n, sizeof(request) - n, "%s: %s\r\n",
+				r->headers[i].name, r->headers[i].value);
+		}
+	}
+	if (n < MIRROR_MAX) {
+		n += snprintf(request + n, sizeof(request) - n, "Connection: close\r\n\r\n");
+	}
+	if (n >= MIRROR_MAX) {
+		debug("Request too large to mirror");
+		return;
+	}
+
+	if (send(MirrorFd, request, n, MSG_DONTWAIT) < 0) {
+		__atomic_add_fetch(&Stats->mirror_dropped, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&Stats->mirrored, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,319 @@
+/* policy.c: Cache-Control Policy Engine */
+
+#include "main.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/* Constants */
+
+#define SUFFIX_KEY	'\001'		/* Prefix of keys for "*.ext" patterns (reversed) */
+#define MIME_KEY	'\002'		/* Prefix of keys for "type/subtype" patterns */
+#define FINGERPRINT	8		/* Minimum hex digits of a fingerprint */
+#define IMMUTABLE	"public, max-age=31536000, immutable"
+
+/**
+ * Cache policy rule
+ */
+typedef struct {
+	char	*value;			/*< Cache-Control header value */
+	long	max_age;		/*< max-age in seconds or -1 for no Expires */
+} PolicyRule;
+
+/**
+ * Node of the compiled pattern trie
+ *
+ * Nodes live in one array and link by index (first child, next sibling),
+ * which keeps the trie compact and the walk free of pointer chasing.
+ */
+typedef struct {
+	unsigned char	label;		/*< Byte consumed by entering this node */
+	int		child;		/*< Index of first child or -1 */
+	int		sibling;	/*< Index of next sibling or -1 */
+	int		exact;		/*< Rule matching a key ending here or -1 */
+	int		prefix;		/*< Rule matching any key through here or -1 */
+} PolicyNode;
+
+static PolicyRule *Rules    = NULL;
+static size_t      NRules   = 0;
+static PolicyNode *Nodes    = NULL;
+static size_t      NNodes   = 0;
+static int         Default  = -1;
+
+/* Built-in rules used when no policy file is specified */
+static const char *DefaultRules[] = {
+	"text/html	no-cache",
+	"text/css	public, max-age=86400",
+	"image/*	public, max-age=86400",
+	"*.js		public, max-age=86400",
+	"*		public, max-age=300",
+};
+
+/**
+ * Allocate trie node.
+ *
+ * @param	label	Byte label of node.
+ * @return	Index of node or -1 on error.
+ **/
+static int policy_node(unsigned char label) {
+	PolicyNode *nodes = realloc(Nodes, (NNodes + 1) * sizeof(PolicyNode));
+	if (!nodes) {
+		log("Unable to realloc: %s", strerror(errno));
+		return -1;
+	}
+	Nodes = nodes;
+	Nodes[NNodes] = (PolicyNode){label, -1, -1, -1, -1};
+	return NNodes++;
+}
+
+/**
+ * Insert key into trie.
+ *
+ * @param	key	Key bytes.
+ * @param	n	Number of key bytes.
+ * @param	rule	Index of rule.
+ * @param	prefix	Whether the rule also matches longer keys.
+ * @return	-1 on error and 0 on success.
+ **/
+static int policy_insert(const char *key, size_t n, int rule, bool prefix) {
+	int node = 0;
+	for (size_t i = 0; i < n; i++) {
+		unsigned char c = key[i];
+		int child = Nodes[node].child;
+		while (child >= 0 && Nodes[child].label != c) {
+			child = Nodes[child].sibling;
+		}
+		if (child < 0) {
+			if ((child = policy_node(c)) < 0) {
+				return -1;
+			}
+			Nodes[child].sibling = Nodes[node].child;
+			Nodes[node].child    = child;
+		}
+		node = child;
+	}
+
+	if (prefix) {
+		Nodes[node].prefix = rule;
+	} else {
+		Nodes[node].exact  = rule;
+	}
+	return 0;
+}
+
+/**
+ * Find most specific rule for key.
+ *
+ * @param	key	Key bytes.
+ * @param	n	Number of key bytes.
+ * @return	Index of rule or -1 if none matches.
+ **/
+static int policy_match(const char *key, size_t n) {
+	int node  = 0;
+	int match = -1;
+	for (size_t i = 0; i < n && node >= 0; i++) {
+		unsigned char c = key[i];
+		node = Nodes[node].child;
+		while (node >= 0 && Nodes[node].label != c) {
+			node = Nodes[node].sibling;
+		}
+		if (node >= 0 && Nodes[node].prefix >= 0) {
+			match = Nodes[node].prefix;
+		}
+	}
+	if (node >= 0 && Nodes[node].exact >= 0) {
+		match = Nodes[node].exact;
+	}
+	return match;
+}
+
+/**
+ * Compile one rule.
+ *
+ * @param	line	Rule in the form "<pattern> <Cache-Control value>".
+ * @return	-1 on error and 0 on success.
+ *
+ * Patterns are "/uri" (exact), "/uri/" followed by "*" (prefix), "*.ext"
+ * (suffix), "type/subtype" or "type/" followed by "*" (MIME type), or "*"
+ * (default).
+ **/
+static int policy_compile(const char *line) {
+	char buffer[BUFSIZ];
+	char key[BUFSIZ];
+	strncpy(buffer, line, BUFSIZ - 1);
+	buffer[BUFSIZ - 1] = 0;
+
+	char *pattern = strtok(buffer, WHITESPACE);
+	if (!pattern || pattern[0] == '#') {
+		return 0;
+	}
+	char *value = strtok(NULL, "\n");
+	if (!value || !*(value = skip_whitespace(value))) {
+		log("Missing Cache-Control value for %s", pattern);
+		return -1;
+	}
+
+	PolicyRule *rules = realloc(Rules, (NRules + 1) * sizeof(PolicyRule));
+	if (!rules) {
+		log("Unable to realloc: %s", strerror(errno));
+		return -1;
+	}
+	Rules = rules;
+
+	int rule = NRules++;
+	char *age = strstr(value, "max-age=");
+	Rules[rule].value   = strdup(value);
+	Rules[rule].max_age = age ? atol(age + 8) : -1;
+
+	size_t n    = strlen(pattern);
+	bool prefix = pattern[n - 1] == '*';
+	if (prefix) {
+		n--;
+	}
+
+	if (streq(pattern, "*")) {
+		Default = rule;
+		return 0;
+	} else if (pattern[0] == '*') {
+		/* Suffix patterns are matched against the reversed URI */
+		key[0] = SUFFIX_KEY;
+		for (size_t i = 1; i < n; i++) {
+			key[i] = pattern[n - i];
+		}
+		return policy_insert(key, n, rule, true);
+	} else if (pattern[0] == '/') {
+		return policy_insert(pattern, n, rule, prefix);
+	} else {
+		key[0] = MIME_KEY;
+		memcpy(key + 1, pattern, n);
+		return policy_insert(key, n + 1, rule, prefix);
+	}
+}
+
+/**
+ * Load and compile cache policy rules.
+ *
+ * @param	path	Path to rules file or NULL for the built-in rules.
+ * @return	-1 on error and 0 on success.
+ *
+ * Each line of the rules file has the form
+ *
+ *   <PATTERN>	<CACHE-CONTROL VALUE>
+ *
+ * and all patterns are compiled into a single trie.
+ **/
+int policy_load(const char *path) {
+	char buffer[BUFSIZ];
+	int status = 0;
+
+	if (policy_node(0) < 0) {
+		return -1;
+	}
+
+	if (!path) {
+		for (size_t i = 0; i < sizeof(DefaultRules) / sizeof(DefaultRules[0]); i++) {
+			status |= policy_compile(DefaultRules[i]);
+		}
+		return status;
+	}
+
+	FILE *fs = fopen(path, "r");
+	if (!fs) {
+		log("Unable to fopen %s: %s", path, strerror(errno));
+		return -1;
+	}
+	while (fgets(buffer, BUFSIZ, fs)) {
+		status |= policy_compile(buffer);
+	}
+	fclose(fs);
+	return status;
+}
+
+/**
+ * Determine whether a URI names a fingerprinted asset.
+ *
+ * @param	uri	Resource path of URI.
+ * @return	true if the file name contains a "." or "-" separated run of at
+ * least FINGERPRINT hex digits (e.g. app.3f9a2b1c.js).
+ **/
+bool policy_fingerprinted(const char *uri) {
+	const char *name = strrchr(uri, '/');
+	name = name ? name + 1 : uri;
+
+	for (const char *s = name; *s; s++) {
+		if (*s != '.' && *s != '-') {
+			continue;
+		}
+		size_t n = 0;
+		while (isxdigit((unsigned char)s[n + 1])) {
+			n++;
+		}
+		if (n >= FINGERPRINT && (s[n + 1] == '.' || s[n + 1] == '-')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Write caching headers for a static response.
+ *
+ * @param	fs		Stream to write headers to.
+ * @param	uri		Resource path of URI.
+ * @param	mimetype	MIME type of response.
+ *
+ * Fingerprinted assets never change, so they are always immutable.  Otherwise
+ * an exact or prefix URI rule wins over a "*.ext" rule, which wins over a MIME
+ * type rule, which wins over the default rule.  Rules with a max-age also get
+ * a matching Expires header.
+ **/
+void write_cache_headers(FILE *fs, const char *uri, const char *mimetype) {
+	char key[BUFSIZ];
+	const char *value = NULL;
+	long max_age = -1;
+
+	if (policy_fingerprinted(uri)) {
+		value   = IMMUTABLE;
+		max_age = 31536000;
+	} else if (Nodes) {
+		size_t n = strlen(uri);
+		int rule = policy_match(uri, n);
+
+		if (rule < 0 && n < BUFSIZ) {
+			key[0] = SUFFIX_KEY;
+			for (size_t i = 1; i <= n; i++) {
+				key[i] = uri[n - i];
+			}
+			rule = policy_match(key, n + 1);
+		}
+		if (rule < 0 && (n = strlen(mimetype)) < BUFSIZ - 1) {
+			key[0] = MIME_KEY;
+			memcpy(key + 1, mimetype, n);
+			rule = policy_match(key, n + 1);
+		}
+		if (rule < 0) {
+			rule = Default;
+		}
+		if (rule >= 0) {
+			value   = Rules[rule].value;
+			max_age = Rules[rule].max_age;
+		}
+	}
+
+	if (!value) {
+		return;
+	}
+	fprintf(fs, "Cache-Control: %s\r\n", value);
+
+	if (max_age >= 0) {
+		char expires[64];
+		time_t when = time(NULL) + max_age;
+		struct tm tm;
+		strftime(expires, sizeof(expires), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&when, &tm));
+		fprintf(fs, "Expires: %s\r\n", expires);
+	}
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
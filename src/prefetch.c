@@ -0,0 +1,279 @@
+/* prefetch.c: Dependency-Aware Prefetching */
+
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define PREFETCH_PAGES		512		/* Pages tracked */
+#define PREFETCH_FOLLOWERS	8		/* Dependencies tracked per page */
+#define PREFETCH_PATH		120		/* Longest dependency path tracked */
+#define PREFETCH_MIN		3		/* Observations before a dependency is trusted */
+#define PREFETCH_DECAY		128		/* Page loads before evidence is halved */
+
+/**
+ * Document observed after a page on the same connection
+ */
+typedef struct {
+	uint64_t	key;			/*< Hash of path or 0 if unused */
+	unsigned int	count;			/*< Times seen after the page */
+	char		path[PREFETCH_PATH];	/*< Path below RootPath */
+} Follower;
+
+/**
+ * Page and the documents that tend to follow it
+ */
+typedef struct {
+	uint64_t	key;			/*< Hash of path or 0 if unused */
+	unsigned int	hits;			/*< Times the page was served */
+	int		lock;			/*< Pid of the process using the entry (0 if none) */
+	Follower	followers[PREFETCH_FOLLOWERS];
+} Page;
+
+/* Global Variables */
+
+static Page *Pages = NULL;			/* Shared by all workers */
+
+/**
+ * Allocate the shared dependency table.
+ *
+ * @return	-1 on error and 0 on success.
+ **/
+int prefetch_init(void) {
+	Pages = mmap(NULL, PREFETCH_PAGES * sizeof(Page), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (Pages == MAP_FAILED) {
+		log("Unable to mmap: %s", strerror(errno));
+		Pages = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Lock the table entry of a page.
+ *
+ * @param	key	Hash of page path.
+ * @return	Locked entry or NULL if it is busy.
+ *
+ * An entry still held by a worker that died while using it is taken over.
+ **/
+static Page * prefetch_lock(uint64_t key) {
+	Page  *p      = &Pages[key % PREFETCH_PAGES];
+	pid_t  self   = getpid();
+	int    holder = 0;
+	if (__atomic_compare_exchange_n(&p->lock, &holder, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return p;
+	}
+	if (kill(holder, 0) < 0 && errno == ESRCH &&
+	    __atomic_compare_exchange_n(&p->lock, &holder, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return p;
+	}
+	return NULL;
+}
+
+/**
+ * Unlock a table entry.
+ *
+ * @param	p	Locked entry.
+ **/
+static void prefetch_unlock(Page *p) {
+	__atomic_store_n(&p->lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Record that a document followed a page.
+ *
+ * @param	page	Hash of page path.
+ * @param	key	Hash of document path.
+ * @param	path	Document path below RootPath.
+ *
+ * A document not yet tracked takes the place of the least seen follower
+ * once that one's count has decayed to zero, so dependencies that stop being
+ * requested are eventually forgotten.
+ **/
+static void prefetch_follow(uint64_t page, uint64_t key, const char *path) {
+	size_t n = strlen(path);
+	Page  *p = n < PREFETCH_PATH ? prefetch_lock(page) : NULL;
+	if (!p) {
+		return;
+	}
+
+	if (p->key == page) {
+		Follower *least = &p->followers[0];
+		for (int i = 0; i < PREFETCH_FOLLOWERS; i++) {
+			Follower *f = &p->followers[i];
+			if (f->key == key) {
+				f->count++;
+				goto unlock;
+			}
+			if (f->count < least->count) {
+				least = f;
+			}
+		}
+		if (least->count > 0 && --least->count > 0) {
+			goto unlock;
+		}
+		least->key   = key;
+		least->count = 1;
+		memcpy(least->path, path, n + 1);
+	}
+
+unlock:
+	prefetch_unlock(p);
+}
+
+/**
+ * Record that a page was served and collect its likely dependencies.
+ *
+ * @param	page		Hash of page path.
+ * @param	followers	Set to the trusted dependencies.
+ * @return	Number of trusted dependencies.
+ *
+ * A dependency is trusted once it has been seen PREFETCH_MIN times and
+ * after at least half of the recent loads of the page.
+ **/
+static int prefetch_predict(uint64_t page, Follower followers[PREFETCH_FOLLOWERS]) {
+	Page *p = prefetch_lock(page);
+	int   n = 0;
+	if (!p) {
+		return 0;
+	}
+
+	if (p->key != page) {
+		p->key  = page;
+		p->hits = 0;
+		memset(p->followers, 0, sizeof(p->followers));
+	}
+	p->hits++;
+
+	for (int i = 0; i < PREFETCH_FOLLOWERS; i++) {
+		Follower *f = &p->followers[i];
+		if (f->key && f->count >= PREFETCH_MIN && 2 * f->count >= p->hits) {
+			followers[n++] = *f;
+		}
+	}
+
+	/* Halve old evidence so the ratio follows the page as it changes */
+	if (p->hits >= PREFETCH_DECAY) {
+		p->hits /= 2;
+		for (int i = 0; i < PREFETCH_FOLLOWERS; i++) {
+			p->followers[i].count /= 2;
+		}
+	}
+
+	prefetch_unlock(p);
+	return n;
+}
+
+/**
+ * Determine the preload destination of a document.
+ *
+ * @param	mimetype	Mimetype of document.
+ * @return	Value for the "as" attribute or NULL if it should not be preloaded.
+ **/
+static const char * prefetch_destination(const char *mimetype) {
+	if (streq(mimetype, "text/css")) {
+		return "style";
+	}
+	if (strstr(mimetype, "javascript")) {
+		return "script";
+	}
+	if (strncmp(mimetype, "image/", 6) == 0) {
+		return "image";
+	}
+	return NULL;
+}
+
+/**
+ * Determine whether a path can be placed in a Link header as is.
+ *
+ * @param	path	Path below RootPath.
+ * @return	true if no character needs escaping.
+ **/
+static bool prefetch_linkable(const char *path) {
+	return path[strspn(path, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789/._~-")] == 0;
+}
+
+/**
+ * Warm up a dependency of a page.
+ *
+ * @param	f	Dependency.
+ * @return	true if the dependency is a small regular file.
+ *
+ * Opening the file already brings its dentry and inode into memory, and
+ * WILLNEED queues the reads of its contents, so by the time the client asks
+ * for it neither needs the disk.  Files in the warm arena are left alone.
+ **/
+static bool prefetch_warm(const Follower *f) {
+	char path[BUFSIZ];
+	struct stat sb;
+	bool small = false;
+
+	snprintf(path, sizeof(path), "%s%s", RootPath, f->path);
+	int fd = open(path, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		return false;
+	}
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size <= CACHE_MAX_FILE) {
+		small = true;
+		if (!warm_file(path, &sb)) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		}
+	}
+	close(fd);
+	return small;
+}
+
+/**
+ * Learn page dependencies and write preload hints for them.
+ *
+ * @param	r		HTTP Request structure.
+ * @param	mimetype	Mimetype of the document being served.
+ *
+ * Every document served on a connection after an HTML page is recorded as
+ * following that page, in a table shared by all workers.  When a page is
+ * served again, its trusted dependencies are warmed up right away and
+ * announced with "Link: <path>; rel=preload" headers, so the client can
+ * request them before it has even parsed the page.
+ **/
+void write_prefetch_headers(Request *r, const char *mimetype) {
+	const char *path = r->path + strlen(RootPath);
+	uint64_t    key  = hash_bytes(path, strlen(path), HASH_INIT) | 1;
+	Follower    followers[PREFETCH_FOLLOWERS];
+
+	if (!Pages) {
+		return;
+	}
+
+	if (strncmp(mimetype, "text/html", 9) != 0) {
+		if (r->peer->page && r->peer->page != key) {
+			prefetch_follow(r->peer->page, key, path);
+		}
+		return;
+	}
+
+	r->peer->page = key;
+	int n = prefetch_predict(key, followers);
+	for (int i = 0; i < n; i++) {
+		if (!prefetch_warm(&followers[i])) {
+			continue;
+		}
+		__atomic_add_fetch(&Stats->prefetched, 1, __ATOMIC_RELAXED);
+
+		char *type = determine_mimetype(followers[i].path);
+		const char *as = type ? prefetch_destination(type) : NULL;
+		if (as && prefetch_linkable(followers[i].path)) {
+			fprintf(r->file, "Link: <%s>; rel=preload; as=%s\r\n", followers[i].path, as);
+		}
+		free(type);
+	}
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
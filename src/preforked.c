@@ -0,0 +1,181 @@
+/* preforked.c: Elastic Pre-Forked HTTP Server */
+
+#include "main.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SCALE_INTERVAL	1		/* Seconds between scaling decisions */
+#define SCALE_UP_BUSY	0.75		/* Busy ratio that calls for more workers */
+#define SCALE_DOWN_BUSY	0.25		/* Busy ratio that allows fewer workers */
+#define SCALE_MAX_CPU	0.90		/* CPU utilisation beyond which not to grow */
+#define SCALE_UP_RUNS	2		/* Consecutive samples before growing */
+#define SCALE_DOWN_RUNS	10		/* Consecutive samples before shrinking */
+
+/* Global Variables */
+
+int MinWorkers = 2;
+int MaxWorkers = 16;
+
+/**
+ * Interrupt a blocked accept so a worker notices it was retired.
+ *
+ * @param	signum	Signal number.
+ **/
+static void worker_wake(int signum) {
+}
+
+/**
+ * Accept and serve connections until retired.
+ *
+ * @param	sfd	Server socket file descriptor.
+ * @param	w	Scoreboard slot of this worker.
+ **/
+static void worker_loop(int sfd, Worker *w) {
+	struct sigaction sa = {.sa_handler = worker_wake};
+	sigaction(SIGUSR1, &sa, NULL);
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	CurrentWorker = w;
+
+	while (!w->retire) {
+		w->state = WORKER_IDLE;
+		Request *r = accept_request(sfd);
+		if (!r) {
+			continue;
+		}
+
+		w->state = WORKER_BUSY;
+		serve_connection(r);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/**
+ * Fork a new worker into a free scoreboard slot.
+ *
+ * @param	sfd	Server socket file descriptor.
+ * @return	-1 on error and 0 on success.
+ **/
+static int spawn_worker(int sfd) {
+	Worker *w = metrics_worker();
+	if (!w) {
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		log("Unable to fork: %s", strerror(errno));
+		w->state = WORKER_FREE;
+		return -1;
+	}
+	if (pid == 0) {
+		worker_loop(sfd, w);
+	}
+	w->pid = pid;
+	return 0;
+}
+
+/**
+ * Retire one idle worker.
+ **/
+static void retire_worker(void) {
+	for (int i = 0; i < MAX_WORKERS; i++) {
+		Worker *w = &Stats->workers[i];
+		if (w->state == WORKER_IDLE && !w->retire) {
+			w->retire = true;
+			kill(w->pid, SIGUSR1);
+			return;
+		}
+	}
+}
+
+/**
+ * Reap exited workers and free their slots.
+ **/
+static void reap_workers(void) {
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		metrics_reap(pid);
+	}
+}
+
+/**
+ * Serve HTTP requests with an elastic pool of pre-forked workers.
+ *
+ * @param	sfd	Server socket file descriptor.
+ * @return	Exit status of the server (EXIT_SUCCESS).
+ *
+ * Each worker accepts connections from the shared server socket.  Every
+ * SCALE_INTERVAL the parent samples the busy-worker ratio, the depth of the
+ * listen queue (and any connections it dropped), and CPU utilisation, and
+ * grows or shrinks the pool between MinWorkers and MaxWorkers.  Growing requires SCALE_UP_RUNS consecutive
+ * overloaded samples and shrinking SCALE_DOWN_RUNS consecutive idle ones,
+ * and the two busy thresholds are far apart, so the pool does not thrash.
+ **/
+int preforked_server(int sfd) {
+	CpuSample cpu = {0};
+	int up_runs   = 0;
+	int down_runs = 0;
+	unsigned long drops = 0;
+
+	cpu_utilisation(&cpu);
+	while (true) {
+		reap_workers();
+
+		/* Count workers (retiring ones are already on their way out) */
+		int alive = 0;
+		int busy  = 0;
+		for (int i = 0; i < MAX_WORKERS; i++) {
+			Worker *w = &Stats->workers[i];
+			if (w->state != WORKER_FREE && !w->retire) {
+				alive++;
+				busy += w->state == WORKER_BUSY;
+			}
+		}
+
+		/* Replace workers that died */
+		for (; alive < MinWorkers && spawn_worker(sfd) == 0; alive++);
+
+		/* Sample load (connections dropped by a full listen queue count as queued) */
+		unsigned int queued = 0;
+		unsigned int backlog = 0;
+		unsigned long total = drops;
+		socket_queue(sfd, &queued, &backlog);
+		if (socket_drops(sfd, &total) == 0 && total > drops) {
+			log("Listen queue overflowed: %lu connections dropped", total - drops);
+			queued += total - drops;
+			drops   = total;
+		}
+		double ratio = alive ? (double)busy / alive : 1.0;
+		double load  = cpu_utilisation(&cpu);
+		debug("Workers %d, busy %d, queued %u, cpu %.2f", alive, busy, queued, load);
+
+		up_runs   = ((ratio >= SCALE_UP_BUSY || queued > 0) && load < SCALE_MAX_CPU) ? up_runs + 1 : 0;
+		down_runs = (ratio <= SCALE_DOWN_BUSY && queued == 0) ? down_runs + 1 : 0;
+
+		/* Grow by a quarter of the pool, shrink one worker at a time */
+		if (up_runs >= SCALE_UP_RUNS && alive < MaxWorkers) {
+			int grow = alive / 4 > 1 ? alive / 4 : 1;
+			for (int i = 0; i < grow && alive < MaxWorkers && spawn_worker(sfd) == 0; i++, alive++);
+			log("Scaled up to %d workers", alive);
+			up_runs = 0;
+		} else if (down_runs >= SCALE_DOWN_RUNS && alive > MinWorkers) {
+			retire_worker();
+			log("Scaled down to %d workers", alive - 1);
+			down_runs = 0;
+		}
+
+		sleep(SCALE_INTERVAL);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
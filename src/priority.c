@@ -0,0 +1,112 @@
+/* priority.c: Request Priority Classes */
+
+#include "main.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/resource.h>
+
+/* Global Variables */
+
+bool PriorityRenice = false;
+
+/**
+ * Capacity reserved for each class.
+ *
+ * A request may only use capacity that is not reserved for a class of higher
+ * priority, so CGI and listings can never starve static files, and nothing can
+ * starve health and metrics checks.
+ */
+static const int Reserve[NPRIORITIES] = {
+	[PRIORITY_HEALTH]	= 8,
+	[PRIORITY_STATIC]	= 32,
+	[PRIORITY_BROWSE]	= 8,
+	[PRIORITY_CGI]		= 0,
+};
+
+/* Scheduling niceness of processes serving each class */
+static const int Niceness[NPRIORITIES] = {
+	[PRIORITY_HEALTH]	= 0,
+	[PRIORITY_STATIC]	= 0,
+	[PRIORITY_BROWSE]	= 5,
+	[PRIORITY_CGI]		= 10,
+};
+
+/**
+ * Return static string corresponding to Priority class.
+ *
+ * @param	p	Priority class.
+ * @return	Corresponding name of class.
+ **/
+const char * priority_string(Priority p) {
+	static const char *PriorityStrings[] = {
+		[PRIORITY_HEALTH]	= "health",
+		[PRIORITY_STATIC]	= "static",
+		[PRIORITY_BROWSE]	= "browse",
+		[PRIORITY_CGI]		= "cgi",
+	};
+	return p < NPRIORITIES ? PriorityStrings[p] : "unknown";
+}
+
+/**
+ * Admit request of specified priority class.
+ *
+ * @param	r	HTTP Request structure.
+ * @param	p	Priority class of request.
+ * @return	true if the request may proceed, false if the class is out
+ * of capacity (the caller should reject it).
+ *
+ * Admission is shared by every worker through the Stats counters, and the
+ * capacity held by each worker is recorded in its scoreboard slot so it can
+ * be released if the worker dies before releasing it itself.  When the
+ * process serves a single connection (PriorityRenice), it is also reniced so
+ * the kernel schedules high priority classes first.  Renicing cannot be
+ * undone without privileges, so such a connection closes after the response.
+ **/
+bool priority_admit(Request *r, Priority p) {
+	int limit = MaxRequests;
+	for (Priority k = 0; k < p; k++) {
+		limit -= Reserve[k];
+	}
+	if (limit < 1) {
+		limit = 1;
+	}
+
+	unsigned int total = __atomic_add_fetch(&Stats->total, 1, __ATOMIC_RELAXED);
+	if (total > (unsigned int)limit) {
+		__atomic_sub_fetch(&Stats->total, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&Stats->rejected[p], 1, __ATOMIC_RELAXED);
+		log("Rejecting %s request: %u active, limit %d", priority_string(p), total - 1, limit);
+		return false;
+	}
+	__atomic_add_fetch(&Stats->active[p], 1, __ATOMIC_RELAXED);
+	if (CurrentWorker) {
+		__atomic_add_fetch(&CurrentWorker->admitted[p], 1, __ATOMIC_RELAXED);
+	}
+	series_in_flight(total);
+
+	if (PriorityRenice && Niceness[p] > 0) {
+		if (setpriority(PRIO_PROCESS, 0, Niceness[p]) < 0) {
+			log("Unable to setpriority: %s", strerror(errno));
+		}
+		r->flags &= ~REQUEST_KEEPALIVE;
+	}
+	return true;
+}
+
+/**
+ * Release capacity held by an admitted request.
+ *
+ * @param	p	Priority class of request.
+ **/
+void priority_release(Priority p) {
+	if (CurrentWorker) {
+		__atomic_sub_fetch(&CurrentWorker->admitted[p], 1, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&Stats->active[p], 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&Stats->total, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&Stats->served[p], 1, __ATOMIC_RELAXED);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
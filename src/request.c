@@ -4,11 +4,62 @@
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 
+#include <fcntl.h>
 #include <unistd.h>
 
 int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
+bool parse_request_keepalive(Request *r);
+
+/* The hot Request fields must stay within one cache line */
+_Static_assert(sizeof(Request) <= 64, "Request no longer fits in a cache line");
+
+/**
+ * Request head handed over with a connection, read before the socket itself.
+ */
+typedef struct {
+	int	fd;			/*< Client socket (dup owned by the stream) */
+	char	*head;			/*< Bytes already read from the socket */
+	size_t	size;			/*< Number of bytes in head */
+	size_t	offset;			/*< Bytes of head consumed so far */
+} Prefix;
+
+/**
+ * Store client address in a right-sized peer struct.
+ *
+ * @param	r	Request structure.
+ * @param	addr	Client address.
+ * @param	len	Length of client address.
+ * @return	-1 on error and 0 on success.
+ **/
+static int request_peer(Request *r, const struct sockaddr *addr, socklen_t len) {
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+
+	/* Lookup client information */
+	int e = getnameinfo(addr, len, host, NI_MAXHOST, port, NI_MAXSERV, 0);
+	if (e != 0) {
+		log("Unable to getnameinfo: %s", gai_strerror(e));
+		return -1;
+	}
+
+	/* Store client information in cold peer struct: host followed by port */
+	size_t hlen = strlen(host) + 1;
+	r->peer = malloc(sizeof(Peer) + hlen + strlen(port) + 1);
+	if (!r->peer) {
+		log("Unable to malloc: %s", strerror(errno));
+		return -1;
+	}
+	r->peer->page        = 0;
+	r->peer->retransmits = 0;
+	r->peer->query       = NULL;
+	memcpy(r->peer->host, host, hlen);
+	r->peer->port = r->peer->host + hlen;
+	strcpy(r->peer->port, port);
+	return 0;
+}
 
 /**
  * Accept request from server socket.
@@ -19,18 +70,17 @@ int parse_request_headers(Request *r);
  * This function does the following
  *
  * 1. Allocates a request struct initialized to 0.
- * 2. Initializes the headers list in the request struct.
- * 3. Accepts a client connection from the server socket.
- * 4. Looks up the client information and stores it in the request struct.
- * 5. Opens the client socket stream for the request struct.
- * 6. Returns the request struct.
+ * 2. Accepts a client connection from the server socket.
+ * 3. Looks up the client information and stores it in a right-sized peer struct.
+ * 4. Opens the client socket stream for the request struct.
+ * 5. Returns the request struct.
  *
  * The returned request struct must be deallocated using free_request.
  **/
 Request * accept_request(int sfd) {
 	Request *r;
-	struct sockaddr raddr;
-	socklen_t rlen = sizeof(struct sockaddr);
+	struct sockaddr_storage raddr;
+	socklen_t rlen = sizeof(raddr);
 
 	/* Allocate request struct (zeroed) */
 	r = calloc(1, sizeof(Request));
@@ -38,31 +88,26 @@ Request * accept_request(int sfd) {
 		log("Unable to calloc: %s", strerror(errno));
 		return NULL;
 	}
+	r->fd = -1;
 
-	int client_fd = accept(sfd, &raddr, &rlen);
+	int client_fd = accept(sfd, (struct sockaddr *)&raddr, &rlen);
 	if (client_fd < 0){
 		log("Unable to accept: %s", strerror(errno));
 		goto fail;
 	}
 	r->fd = client_fd;
 
-	/* Lookup client information */
-	int e = getnameinfo(&raddr, rlen, r->host, NI_MAXHOST, r->port, NI_MAXSERV, 0);
-	if (e != 0) {
-		log("Unable to getnameinfo: %s", gai_strerror(e));
+	if (request_peer(r, (struct sockaddr *)&raddr, rlen) < 0) {
 		goto fail;
 	}
 
 	/* Open Socket Stream */
-	FILE *client_file = fdopen(client_fd, "w+");
-	if (!client_file) {
-		log("Unable to fdopen: %s",strerror(errno));
-		close(client_fd);
+	if (resume_request(r) < 0) {
 		goto fail;
 	}
-	r->file = client_file;
 
-	log("Accepted request from %s:%s",r->host,r->port);
+	log("Accepted request from %s:%s",r->peer->host,r->peer->port);
+	metrics_connection(1);
 	return r;
 
 fail:
@@ -71,6 +116,131 @@ fail:
 	return NULL;
 }
 
+/**
+ * Read from a prefixed stream: first the handed over head, then the socket.
+ **/
+static ssize_t prefix_read(void *cookie, char *buffer, size_t size) {
+	Prefix *p = cookie;
+	if (p->offset < p->size) {
+		size_t n = p->size - p->offset < size ? p->size - p->offset : size;
+		memcpy(buffer, p->head + p->offset, n);
+		p->offset += n;
+		return n;
+	}
+	return read(p->fd, buffer, size);
+}
+
+/**
+ * Close a prefixed stream.
+ **/
+static int prefix_close(void *cookie) {
+	Prefix *p = cookie;
+	int status = close(p->fd);
+	free(p->head);
+	free(p);
+	return status;
+}
+
+/**
+ * Open the output stream of a request.
+ *
+ * @param	r	Request structure.
+ * @return	-1 on error and 0 on success.
+ *
+ * Responses get a write-only stream of their own.  A single read/write
+ * stream cannot be used: glibc seeks back over unread input before writing,
+ * and on a socket that seek fails and the output is silently discarded, so
+ * any response to a request followed by more data (a pipelined request or
+ * an unread body) would be lost.
+ **/
+static int request_output(Request *r) {
+	int fd = dup(r->fd);
+	if (fd < 0) {
+		log("Unable to dup: %s", strerror(errno));
+		return -1;
+	}
+
+	r->file = fdopen(fd, "w");
+	if (!r->file) {
+		log("Unable to fdopen: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Adopt a connection whose request head was already read by another process.
+ *
+ * @param	fd	Client socket file descriptor (owned by the request).
+ * @param	head	Bytes already read from the socket.
+ * @param	n	Number of bytes in head.
+ * @return	Newly allocated Request structure or NULL on error.
+ *
+ * The socket stream replays the head before reading from the socket, so the
+ * request is parsed exactly as if it had been accepted here.  Once the head
+ * is consumed and the connection parked, it resumes with a plain stream.
+ *
+ * The returned request struct must be deallocated using free_request.
+ **/
+Request * adopt_request(int fd, const char *head, size_t n) {
+	struct sockaddr_storage raddr;
+	socklen_t rlen = sizeof(raddr);
+
+	Request *r = calloc(1, sizeof(Request));
+	if (!r) {
+		log("Unable to calloc: %s", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	r->fd = fd;
+
+	if (getpeername(fd, (struct sockaddr *)&raddr, &rlen) < 0) {
+		log("Unable to getpeername: %s", strerror(errno));
+		goto fail;
+	}
+	if (request_peer(r, (struct sockaddr *)&raddr, rlen) < 0) {
+		goto fail;
+	}
+
+	/* Open input stream that replays the head first (responses go through
+	 * the output stream, as for accepted requests) */
+	Prefix *p = calloc(1, sizeof(Prefix));
+	if (!p || !(p->head = malloc(n ? n : 1))) {
+		log("Unable to malloc: %s", strerror(errno));
+		free(p);
+		goto fail;
+	}
+	memcpy(p->head, head, n);
+	p->size = n;
+	if ((p->fd = dup(fd)) < 0) {
+		log("Unable to dup: %s", strerror(errno));
+		free(p->head);
+		free(p);
+		goto fail;
+	}
+
+	cookie_io_functions_t io = {
+		.read	= prefix_read,
+		.close	= prefix_close,
+	};
+	r->in = fopencookie(p, "r", io);
+	if (!r->in) {
+		log("Unable to fopencookie: %s", strerror(errno));
+		prefix_close(p);
+		goto fail;
+	}
+	if (request_output(r) < 0) {
+		goto fail;
+	}
+
+	log("Adopted request from %s:%s", r->peer->host, r->peer->port);
+	return r;
+
+fail:
+	free_request(r);
+	return NULL;
+}
 
 /**
  * Deallocate request struct.
@@ -79,10 +249,9 @@ fail:
  *
  * This function does the following
  *
- * 1. Closes the request socket stream or file descriptor.
- * 2. Frees all allocated strings in request struct.
- * 3. Frees all of the headers (including any allocated fields).
- * 4. Frees request struct.
+ * 1. Closes the request socket stream and file descriptor.
+ * 2. Frees all allocated strings and headers in request struct.
+ * 3. Frees the peer struct and the request struct.
  **/
 void free_request(Request *r) {
 	log("Freeing request...");
@@ -90,28 +259,118 @@ void free_request(Request *r) {
 		return;
 	}
 
-	/* Close socket file or fd */
-	fclose(r->file);
+	/* Close socket streams and fd */
+	if (r->in) {
+		fclose(r->in);
+	}
+	if (r->file) {
+		fclose(r->file);
+	}
+	if (r->fd >= 0) {
+		close(r->fd);
+	}
 
+	/* Free parsed state */
+	reset_request(r);
+
+	/* Free peer and request */
+	free(r->peer);
+	free(r);
+}
+
+/**
+ * Reset parsed request state.
+ *
+ * @param	r	Request structure.
+ *
+ * This frees the method, uri, path, query, and headers so the next request on
+ * a persistent connection can be parsed into the same struct.
+ **/
+void reset_request(Request *r) {
 	/*Free alloacted strings */
 	free(r->method);
 	free(r->uri);
 	free(r->path);
-	free(r->query);
+	r->method = r->uri = r->path = NULL;
+	if (r->peer) {
+		free(r->peer->query);
+		r->peer->query = NULL;
+	}
 
-	
 	/* Free headers */
-	struct header *temp;
-	while(r->headers) {
-		temp = r->headers->next;
-		free(r->headers->name);
-		free(r->headers->value);
-		free(r->headers);
-		r->headers = temp;
+	for (unsigned int i = 0; i < r->nheaders; i++) {
+		free(r->headers[i].name);
+		free(r->headers[i].value);
 	}
+	free(r->headers);
+	r->headers  = NULL;
+	r->nheaders = 0;
+	r->flags   &= ~(REQUEST_KEEPALIVE | REQUEST_HTTP11 | REQUEST_DELIMITED);
+}
 
-	/* Free request */
-	free(r);
+/**
+ * Park an idle request.
+ *
+ * @param	r	Request structure.
+ * @return	true if the request was parked, false if input is already
+ * buffered and the next request should be handled immediately.
+ *
+ * This releases the parsed state and the socket streams (with their stdio
+ * buffers), leaving only the fd, flags, and peer stub allocated while the
+ * connection waits for its next request.
+ **/
+bool park_request(Request *r) {
+	reset_request(r);
+
+	/* Probe the input stream without blocking for pipelined input */
+	int fl = fcntl(r->fd, F_GETFL);
+	fcntl(r->fd, F_SETFL, fl | O_NONBLOCK);
+	int c = fgetc(r->in);
+	fcntl(r->fd, F_SETFL, fl);
+	if (c != EOF) {
+		ungetc(c, r->in);
+		return false;
+	}
+	clearerr(r->in);
+
+	fclose(r->in);
+	fclose(r->file);
+	r->in     = NULL;
+	r->file   = NULL;
+	r->flags |= REQUEST_PARKED;
+	return true;
+}
+
+/**
+ * Resume a parked request.
+ *
+ * @param	r	Request structure.
+ * @return	-1 on error and 0 on success.
+ *
+ * This (re)opens the input and output streams, each over its own duplicate of
+ * the client fd, so that closing them when parking leaves the connection
+ * itself open.
+ **/
+int resume_request(Request *r) {
+	int fd = dup(r->fd);
+	if (fd < 0) {
+		log("Unable to dup: %s", strerror(errno));
+		return -1;
+	}
+
+	r->in = fdopen(fd, "r");
+	if (!r->in) {
+		log("Unable to fdopen: %s",strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (request_output(r) < 0) {
+		fclose(r->in);
+		r->in = NULL;
+		return -1;
+	}
+	r->flags &= ~REQUEST_PARKED;
+	return 0;
 }
 
 /**
@@ -130,6 +389,8 @@ int parse_request(Request *r) {
 		return -1;
 	if(parse_request_headers(r) != 0)
 		return -1;
+	if (KeepAliveTimeout > 0 && parse_request_keepalive(r))
+		r->flags |= REQUEST_KEEPALIVE;
 	return 0;
 }
 
@@ -148,16 +409,18 @@ int parse_request(Request *r) {
  *   GET / HTTP/1.1
  *   GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, and query (if it exists), and
+ * records whether the client speaks HTTP/1.1.
  **/
 int parse_request_method(Request *r) {
 	char buffer[BUFSIZ];
 	char *method;
 	char *uri;
+	char *version;
 	char *query = "";
 
 	/* Read line from socket */
-	if(!fgets(buffer,BUFSIZ,r->file)) {
+	if(!fgets(buffer,BUFSIZ,r->in)) {
 		log("Failed to read line from socket");
 		goto fail;
 	}
@@ -165,9 +428,15 @@ int parse_request_method(Request *r) {
 	/* Parse method and uri */
 	method 	= strtok(buffer, " \t\n");
 	uri	= strtok(NULL, " \t\n");
+	version	= strtok(NULL, " \t\r\n");
 
 	if (!method || !uri)
 		goto fail;
+
+	if (version && streq(version, "HTTP/1.1"))
+		r->flags |= REQUEST_HTTP11;
+	else
+		r->flags &= ~REQUEST_HTTP11;
 	
 	/* Parse query from uri */
 	if (strchr(uri, '?')) {
@@ -179,7 +448,7 @@ int parse_request_method(Request *r) {
 	/* record method, uri and query in request struct */
 	r->method = strdup(method);
 	r->uri = strdup(uri);
-	r->query = strdup(query);
+	r->peer->query = strdup(query);
 
 	return 0;
 
@@ -210,36 +479,52 @@ fail:
  * pseudo-code:
  *   while (buffer = read_from_socket() and buffer is not empty:
  *       name, value 	= buffer.split(':')
- *       header		= new Header(name, value)
+ *       header		= Header(name, value)
  *       headers.append(header)
+ *
+ * The headers are stored in a single contiguous array so lookups scan
+ * adjacent memory instead of chasing list pointers.
  **/
  int parse_request_headers(Request *r) {
-	 struct header *curr = NULL;
 	 char buffer[BUFSIZ];
 	 char *value;
-
+	 unsigned int capacity = 0;
 
 	/* Parse headers from socket */
-	while(fgets(buffer,BUFSIZ,r->file) && strlen(buffer) > 2) {
+	while(fgets(buffer,BUFSIZ,r->in) && strlen(buffer) > 2) {
 	       	chomp(buffer);
-		struct header *new = malloc(sizeof(struct header));
 		char *colon = strchr(buffer, ':');
 		if (!colon) {
-			free(new);
 			goto fail;
 		}
+
+		/* Grow headers array */
+		if (r->nheaders == MAX_HEADERS) {
+			log("Too many headers");
+			goto fail;
+		}
+		if (r->nheaders == capacity) {
+			capacity = capacity ? 2 * capacity : 8;
+			Header *headers = realloc(r->headers, capacity * sizeof(Header));
+			if (!headers) {
+				log("Unable to realloc: %s", strerror(errno));
+				goto fail;
+			}
+			r->headers = headers;
+		}
+
+		Header *new = &r->headers[r->nheaders++];
 		new->name = strndup(buffer, colon - buffer);
 		value = skip_whitespace(colon + 1); // + 1 to skip over ':'
+		if (value[0] && value[strlen(value) - 1] == '\r') {
+			chomp(value);
+		}
 		new->value = strdup(value);
-		new->next = curr;
-		curr = new;
 	}
 
-	r->headers = curr;
-
 #ifndef NDEBUG
-	for (struct header *header = r->headers; header; header = header->next) {
-		debug("HTTP HEADER %s = %s", header->name, header->value);
+	for (unsigned int i = 0; i < r->nheaders; i++) {
+		debug("HTTP HEADER %s = %s", r->headers[i].name, r->headers[i].value);
 	}
 #endif
 	return 0;
@@ -248,4 +533,44 @@ fail:
 	return -1;
 }
 
+/**
+ * Determine whether the connection should persist after this request.
+ *
+ * @param	r	Request structure.
+ * @return	true if the client wants a persistent connection.
+ *
+ * HTTP/1.1 connections persist unless the client sends "Connection: close",
+ * while HTTP/1.0 connections must ask for "Connection: keep-alive".  Requests
+ * with a body are never kept alive, since the handlers do not consume it.
+ **/
+bool parse_request_keepalive(Request *r) {
+	const char *connection = request_header(r, "Connection");
+	const char *length     = request_header(r, "Content-Length");
+
+	if (request_header(r, "Transfer-Encoding") || (length && atol(length) > 0)) {
+		return false;
+	}
+
+	if (r->flags & REQUEST_HTTP11) {
+		return !connection || !strcasestr(connection, "close");
+	}
+	return connection && strcasestr(connection, "keep-alive");
+}
+
+/**
+ * Lookup HTTP Request Header.
+ *
+ * @param	r	Request structure.
+ * @param	name	Name of header (case-insensitive).
+ * @return	Value of the first matching header or NULL if not present.
+ **/
+const char * request_header(Request *r, const char *name) {
+	for (unsigned int i = 0; i < r->nheaders; i++) {
+		if (strcasecmp(r->headers[i].name, name) == 0) {
+			return r->headers[i].value;
+		}
+	}
+	return NULL;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c */
@@ -0,0 +1,321 @@
+/* series.c: Recent Metrics at One-Second Resolution */
+
+#include "main.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SERIES_SECONDS		3600		/* Seconds of history kept */
+#define SERIES_STRIPES		8		/* Rings shared out among workers */
+#define SERIES_BUCKETS		12		/* Latency buckets (plus one for slower) */
+#define SERIES_STATUSES		(HTTP_STATUS_SERVICE_UNAVAILABLE + 1)
+#define SERIES_WAIT		100		/* Yields a reader waits for a busy entry */
+
+/**
+ * Latency bucket bounds in milliseconds
+ */
+static const unsigned int LatencyBounds[SERIES_BUCKETS] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000,
+};
+
+/**
+ * Everything recorded during one second
+ */
+typedef struct {
+	time_t		second;				/*< Second recorded (0 if unused) */
+	int		lock;				/*< Pid of the process using the entry (0 if none) */
+	unsigned int	statuses[SERIES_STATUSES];	/*< Requests completed per Status */
+	unsigned int	latency[SERIES_BUCKETS + 1];	/*< Requests per latency bucket */
+	unsigned int	in_flight;			/*< Most admitted requests in progress at once */
+	unsigned int	connections;			/*< Most client connections open at once */
+	unsigned int	events[NSERIESEVENTS];		/*< Cache hits and misses, CGI spawns */
+} Second;
+
+/* Global Variables */
+
+static Second (*Series)[SERIES_SECONDS] = NULL;	/* Shared by all workers */
+
+/**
+ * Allocate the shared rings.
+ *
+ * @return	-1 on error and 0 on success.
+ **/
+int series_init(void) {
+	Series = mmap(NULL, SERIES_STRIPES * sizeof(*Series), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (Series == MAP_FAILED) {
+		log("Unable to mmap: %s", strerror(errno));
+		Series = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Lock the entry of the current second.
+ *
+ * @return	Locked entry or NULL if every ring is busy.
+ *
+ * Each worker starts from the ring picked by its pid and moves on to the
+ * next one if that is busy, so workers never wait on each other.  An entry
+ * still holding a second from an hour ago is cleared first.
+ **/
+static Second * series_lock(void) {
+	time_t now  = time(NULL);
+	pid_t  self = getpid();
+	if (!Series) {
+		return NULL;
+	}
+
+	for (int i = 0; i < SERIES_STRIPES; i++) {
+		Second *s = &Series[(self + i) % SERIES_STRIPES][now % SERIES_SECONDS];
+		int unlocked = 0;
+		if (!__atomic_compare_exchange_n(&s->lock, &unlocked, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		if (s->second != now) {
+			memset(s->statuses, 0, sizeof(Second) - offsetof(Second, statuses));
+			s->second = now;
+		}
+		return s;
+	}
+	return NULL;
+}
+
+/**
+ * Unlock an entry.
+ *
+ * @param	s	Locked entry.
+ **/
+static void series_unlock(Second *s) {
+	__atomic_store_n(&s->lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Record a completed request.
+ *
+ * @param	status	Status of the request.
+ * @param	elapsed	Milliseconds spent handling it.
+ **/
+void series_request(Status status, long elapsed) {
+	Second *s = series_lock();
+	if (!s) {
+		return;
+	}
+
+	int bucket = 0;
+	while (bucket < SERIES_BUCKETS && elapsed > LatencyBounds[bucket]) {
+		bucket++;
+	}
+	s->latency[bucket]++;
+	if (status < SERIES_STATUSES) {
+		s->statuses[status]++;
+	}
+	series_unlock(s);
+}
+
+/**
+ * Record the number of requests in flight.
+ *
+ * @param	requests	Admitted requests being handled by all workers,
+ * including one just admitted.
+ *
+ * This counts requests between admission and release, not connections:
+ * keep-alive connections waiting for their next request are counted by
+ * series_connections.  The open connections are recorded along with it, so
+ * every second with requests has their peak even without new connections.
+ **/
+void series_in_flight(unsigned int requests) {
+	unsigned int open = __atomic_load_n(&Stats->connections, __ATOMIC_RELAXED);
+	Second *s = series_lock();
+	if (s) {
+		s->in_flight   = requests > s->in_flight ? requests : s->in_flight;
+		s->connections = open > s->connections ? open : s->connections;
+		series_unlock(s);
+	}
+}
+
+/**
+ * Record the number of open client connections.
+ *
+ * @param	open	Connections open, including one just accepted.
+ *
+ * This includes idle keep-alive connections, which hold on to file
+ * descriptors and memory while no request is in flight on them.
+ **/
+void series_connections(unsigned int open) {
+	Second *s = series_lock();
+	if (s) {
+		s->connections = open > s->connections ? open : s->connections;
+		series_unlock(s);
+	}
+}
+
+/**
+ * Record an event.
+ *
+ * @param	event	What happened.
+ **/
+void series_event(SeriesEvent event) {
+	Second *s = series_lock();
+	if (s) {
+		s->events[event]++;
+		series_unlock(s);
+	}
+}
+
+/**
+ * Estimate a latency percentile.
+ *
+ * @param	latency	Merged latency buckets.
+ * @param	count	Requests in the buckets.
+ * @param	q	Quantile (e.g. 0.99).
+ * @return	Upper bound in milliseconds or 0 if slower than every bound.
+ **/
+static unsigned int series_percentile(const unsigned int *latency, unsigned int count, double q) {
+	unsigned long rank = (unsigned long)(q * count + 0.999999);
+	unsigned long seen = 0;
+	for (int i = 0; i < SERIES_BUCKETS; i++) {
+		seen += latency[i];
+		if (seen >= rank) {
+			return LatencyBounds[i];
+		}
+	}
+	return 0;
+}
+
+/**
+ * Write one merged second as a JSON object.
+ *
+ * @param	fs	Stream to write to.
+ * @param	m	Merged entry.
+ * @param	first	Whether this is the first object written.
+ **/
+static void series_write_second(FILE *fs, const Second *m, bool first) {
+	unsigned int requests = 0;
+	for (int i = 0; i < SERIES_STATUSES; i++) {
+		requests += m->statuses[i];
+	}
+	unsigned int counted = 0;
+	for (int i = 0; i <= SERIES_BUCKETS; i++) {
+		counted += m->latency[i];
+	}
+
+	fprintf(fs, "%s\n{\"time\":%lld,\"requests\":%u,\"status\":{", first ? "" : ",", (long long)m->second, requests);
+	bool separate = false;
+	for (int i = 0; i < SERIES_STATUSES; i++) {
+		if (m->statuses[i]) {
+			fprintf(fs, "%s\"%.3s\":%u", separate ? "," : "", http_status_string(i), m->statuses[i]);
+			separate = true;
+		}
+	}
+	fputs("}", fs);
+
+	for (int i = 0; i < 2; i++) {
+		double       q     = i ? 0.99 : 0.50;
+		unsigned int bound = counted ? series_percentile(m->latency, counted, q) : 0;
+		if (bound) {
+			fprintf(fs, ",\"p%d_ms\":%u", i ? 99 : 50, bound);
+		} else {
+			fprintf(fs, ",\"p%d_ms\":null", i ? 99 : 50);
+		}
+	}
+
+	unsigned int hits    = m->events[SERIES_CACHE_HIT];
+	unsigned int lookups = hits + m->events[SERIES_CACHE_MISS];
+	fprintf(fs, ",\"requests_in_flight\":%u,\"connections\":%u,\"cache_hits\":%u,\"cache_misses\":%u", m->in_flight, m->connections, hits, lookups - hits);
+	if (lookups) {
+		fprintf(fs, ",\"cache_hit_ratio\":%.3f", (double)hits / lookups);
+	} else {
+		fputs(",\"cache_hit_ratio\":null", fs);
+	}
+	fprintf(fs, ",\"cgi_spawns\":%u}", m->events[SERIES_CGI_SPAWN]);
+}
+
+/**
+ * Lock an entry for reading.
+ *
+ * @param	s	Entry to lock.
+ * @return	true if locked, false if the entry stayed busy.
+ *
+ * An entry still held by a worker that died while writing is taken over;
+ * one that stays busy longer than SERIES_WAIT yields is left out.
+ **/
+static bool series_read_lock(Second *s) {
+	pid_t self = getpid();
+	for (int i = 0; i < SERIES_WAIT; i++) {
+		int holder = 0;
+		if (__atomic_compare_exchange_n(&s->lock, &holder, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return true;
+		}
+		if (kill(holder, 0) < 0 && errno == ESRCH &&
+		    __atomic_compare_exchange_n(&s->lock, &holder, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return true;
+		}
+		sched_yield();
+	}
+	return false;
+}
+
+/**
+ * Write recent seconds as JSON.
+ *
+ * @param	fs	Stream to write to.
+ * @param	seconds	How many of the most recent seconds to write.
+ *
+ * The rings are merged on read: counts add up, the peaks of requests in
+ * flight and open connections are the largest of any ring (each records the
+ * server-wide count), and percentiles come from the merged latency buckets
+ * (as the upper bound of the bucket, null if slower than all of them).
+ * Seconds without any activity, and entries that stay busy, are left out.
+ **/
+void write_series(FILE *fs, int seconds) {
+	time_t now   = time(NULL);
+	bool   first = true;
+
+	seconds = seconds > 0 && seconds < SERIES_SECONDS ? seconds : SERIES_SECONDS;
+	fputs("{\"interval\":1,\"seconds\":[", fs);
+
+	for (time_t t = now - seconds + 1; Series && t <= now; t++) {
+		Second merged = {.second = t};
+		bool   found  = false;
+
+		for (int i = 0; i < SERIES_STRIPES; i++) {
+			Second *s = &Series[i][t % SERIES_SECONDS];
+			if (!series_read_lock(s)) {
+				continue;
+			}
+			if (s->second == t) {
+				found = true;
+				for (int j = 0; j < SERIES_STATUSES; j++) {
+					merged.statuses[j] += s->statuses[j];
+				}
+				for (int j = 0; j <= SERIES_BUCKETS; j++) {
+					merged.latency[j] += s->latency[j];
+				}
+				for (int j = 0; j < NSERIESEVENTS; j++) {
+					merged.events[j] += s->events[j];
+				}
+				merged.in_flight   = s->in_flight > merged.in_flight ? s->in_flight : merged.in_flight;
+				merged.connections = s->connections > merged.connections ? s->connections : merged.connections;
+			}
+			series_unlock(s);
+		}
+
+		if (found) {
+			series_write_second(fs, &merged, first);
+			first = false;
+		}
+	}
+	fputs("\n]}\n", fs);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -12,8 +12,13 @@
  *
  * @param 	sfd	Server socket file descriptor.
  * @return	Exit status of server (EXIT_SUCCESS).
+ *
+ * Connections are closed without lingering, since every other client would
+ * wait for it.
  **/
 int single_server(int sfd) {
+	ConnectionLinger = false;
+
 	/* Accept and handle HTTP request */
 	while (true) {
 		/* Accept request */
@@ -24,7 +29,8 @@ int single_server(int sfd) {
 		/* Handle request */
 		handle_request(r);
 
-		/* free request */
+		/* Close gracefully and free request */
+		close_connection(r);
 		free_request(r);
 	}
 
@@ -0,0 +1,223 @@
+/* snapshot.c: Hot Set Snapshots Across Restarts */
+
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SNAPSHOT_SLOTS	1024
+#define SNAPSHOT_PATH	240			/* Longest path tracked */
+#define SNAPSHOT_MAGIC	"HOTSET01"
+
+/**
+ * Hot set entry for one document
+ */
+typedef struct {
+	uint64_t	key;			/*< Hash of path or 0 if unused */
+	unsigned int	hits;			/*< Decayed request count */
+	int		lock;			/*< Pid of the process rewriting the entry (0 if none) */
+	off_t		size;			/*< Document size when last served */
+	struct timespec	mtime;			/*< Document mtime when last served */
+	char		path[SNAPSHOT_PATH];	/*< Real path of document */
+} HotEntry;
+
+/**
+ * Snapshot file layout
+ */
+typedef struct {
+	char		magic[8];		/*< SNAPSHOT_MAGIC */
+	uint32_t	slots;			/*< SNAPSHOT_SLOTS */
+	uint32_t	entry;			/*< sizeof(HotEntry) */
+	HotEntry	entries[SNAPSHOT_SLOTS];
+} Snapshot;
+
+/* Global Variables */
+
+char *SnapshotPath = NULL;
+
+static Snapshot *Hot          = NULL;		/* Shared by all workers */
+static char      SnapshotTemp[BUFSIZ];
+static pid_t     SnapshotOwner = 0;
+
+/**
+ * Write the hot set to the snapshot file and exit.
+ *
+ * @param	signum	Signal number.
+ *
+ * Only the server process saves; workers that inherited this handler die
+ * from the signal as they would have without it.  Everything here is async
+ * signal safe: the table is written with a single write to a temporary file
+ * that is then renamed over the snapshot.
+ **/
+static void snapshot_save(int signum) {
+	if (getpid() != SnapshotOwner) {
+		signal(signum, SIG_DFL);
+		raise(signum);
+		return;
+	}
+
+	int fd = open(SnapshotTemp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		ssize_t n = write(fd, Hot, sizeof(Snapshot));
+		if (close(fd) == 0 && n == sizeof(Snapshot)) {
+			rename(SnapshotTemp, SnapshotPath);
+		}
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+/**
+ * Restore the hot set from the snapshot file.
+ *
+ * @return	Number of entries restored.
+ *
+ * Entries whose document changed or disappeared are dropped, and the hit
+ * counts of the rest are halved so popularity from long ago fades across
+ * restarts.  Each restored document is prefetched with WILLNEED, which only
+ * queues the reads, so startup does not wait on them.
+ **/
+static size_t snapshot_restore(void) {
+	int fd = open(SnapshotPath, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+
+	Snapshot *saved = mmap(NULL, sizeof(Snapshot), PROT_READ, MAP_PRIVATE, fd, 0);
+	struct stat sb;
+	bool valid = saved != MAP_FAILED && fstat(fd, &sb) == 0 && sb.st_size == sizeof(Snapshot) &&
+		memcmp(saved->magic, SNAPSHOT_MAGIC, 8) == 0 &&
+		saved->slots == SNAPSHOT_SLOTS && saved->entry == sizeof(HotEntry);
+	close(fd);
+	if (!valid) {
+		log("Ignoring invalid snapshot %s", SnapshotPath);
+		if (saved != MAP_FAILED) {
+			munmap(saved, sizeof(Snapshot));
+		}
+		return 0;
+	}
+
+	size_t restored = 0;
+	for (size_t i = 0; i < SNAPSHOT_SLOTS; i++) {
+		const HotEntry *e = &saved->entries[i];
+		if (!e->key || e->hits < 2 || memchr(e->path, 0, SNAPSHOT_PATH) == NULL ||
+		    stat(e->path, &sb) < 0 || sb.st_size != e->size ||
+		    sb.st_mtim.tv_sec != e->mtime.tv_sec || sb.st_mtim.tv_nsec != e->mtime.tv_nsec) {
+			continue;
+		}
+
+		Hot->entries[i]      = *e;
+		Hot->entries[i].hits = e->hits / 2;
+		Hot->entries[i].lock = 0;
+		restored++;
+
+		if ((fd = open(e->path, O_RDONLY)) >= 0) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+	}
+	munmap(saved, sizeof(Snapshot));
+	return restored;
+}
+
+/**
+ * Set up the shared hot set and restore the previous one.
+ *
+ * @return	-1 on error and 0 on success.
+ *
+ * Without a SnapshotPath nothing is tracked.  Otherwise the hot set lives in
+ * a shared mapping every worker records into, is restored from the snapshot
+ * left by the previous process, and is saved again on SIGTERM or SIGINT.
+ **/
+int snapshot_init(void) {
+	if (!SnapshotPath) {
+		return 0;
+	}
+
+	Hot = mmap(NULL, sizeof(Snapshot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (Hot == MAP_FAILED) {
+		log("Unable to mmap: %s", strerror(errno));
+		Hot = NULL;
+		return -1;
+	}
+	memcpy(Hot->magic, SNAPSHOT_MAGIC, 8);
+	Hot->slots = SNAPSHOT_SLOTS;
+	Hot->entry = sizeof(HotEntry);
+
+	log("Restored %zu hot documents from %s", snapshot_restore(), SnapshotPath);
+
+	snprintf(SnapshotTemp, sizeof(SnapshotTemp), "%s.tmp", SnapshotPath);
+	SnapshotOwner = getpid();
+	struct sigaction sa = {.sa_handler = snapshot_save};
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	return 0;
+}
+
+/**
+ * Record a request for a document.
+ *
+ * @param	path	Real path of document.
+ * @param	sb	Stat information of document.
+ *
+ * Each path maps to one slot.  A hit on another path decays the occupant,
+ * which is replaced once its count reaches zero, so the table converges on
+ * the most requested documents.  Entries are rewritten under a per-slot
+ * lock; a worker that finds the lock taken simply skips recording, unless
+ * its holder died while rewriting, in which case the slot is taken over.
+ **/
+void snapshot_record(const char *path, const struct stat *sb) {
+	size_t n = strlen(path);
+	if (!Hot || n >= SNAPSHOT_PATH) {
+		return;
+	}
+
+	uint64_t key = hash_bytes(path, n, HASH_INIT) | 1;
+	HotEntry *e  = &Hot->entries[key % SNAPSHOT_SLOTS];
+	pid_t self   = getpid();
+	int   holder = 0;
+	if (!__atomic_compare_exchange_n(&e->lock, &holder, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) &&
+	    (kill(holder, 0) == 0 || errno != ESRCH ||
+	     !__atomic_compare_exchange_n(&e->lock, &holder, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))) {
+		return;
+	}
+
+	if (e->key != key) {
+		if (e->hits > 0 && --e->hits > 0) {
+			goto unlock;
+		}
+		e->key = key;
+		memcpy(e->path, path, n + 1);
+	}
+	e->hits++;
+	e->size  = sb->st_size;
+	e->mtime = sb->st_mtim;
+
+unlock:
+	__atomic_store_n(&e->lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Lookup the recorded popularity of a document.
+ *
+ * @param	path	Real path of document.
+ * @return	Decayed request count (0 if not in the hot set).
+ **/
+unsigned int snapshot_hits(const char *path) {
+	size_t n = strlen(path);
+	if (!Hot || n >= SNAPSHOT_PATH) {
+		return 0;
+	}
+
+	uint64_t key = hash_bytes(path, n, HASH_INIT) | 1;
+	HotEntry *e  = &Hot->entries[key % SNAPSHOT_SLOTS];
+	return e->key == key ? e->hits : 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -9,6 +9,8 @@
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <linux/sock_diag.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -22,6 +24,8 @@
 const char *HOST = NULL;
 const char *PORT = "9422";
 
+int ServerSocket = -1;		/* Listening socket (for metrics) */
+
 int socket_listen(const char *port) {
 	/* Lookup server address information */
 	struct addrinfo hints = {
@@ -63,7 +67,116 @@ int socket_listen(const char *port) {
 	}
 
 	freeaddrinfo(results);
+	ServerSocket = socket_fd;
 	return socket_fd;
 }
 
+/**
+ * Query the accept queue of a listening socket.
+ *
+ * @param	sfd	Server socket file descriptor.
+ * @param	queued	Set to number of connections waiting to be accepted.
+ * @param	backlog	Set to maximum length of the accept queue.
+ * @return	-1 on error and 0 on success.
+ *
+ * For listening sockets Linux reports the accept queue length and limit in
+ * the tcpi_unacked and tcpi_sacked fields of TCP_INFO.
+ **/
+int socket_queue(int sfd, unsigned int *queued, unsigned int *backlog) {
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if (getsockopt(sfd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+		return -1;
+	}
+	*queued  = info.tcpi_unacked;
+	*backlog = info.tcpi_sacked;
+	return 0;
+}
+
+/**
+ * Query the connections a listening socket has dropped.
+ *
+ * @param	sfd	Server socket file descriptor.
+ * @param	drops	Set to number of connections dropped since the socket was created.
+ * @return	-1 on error and 0 on success.
+ *
+ * The kernel drops handshakes itself when the accept queue is full (or the
+ * SYN cannot be answered), before accept ever sees them, counting each in
+ * the listener's sk_drops, which SO_MEMINFO reports.
+ **/
+int socket_drops(int sfd, unsigned long *drops) {
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(meminfo);
+	if (getsockopt(sfd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0 || len <= SK_MEMINFO_DROPS * sizeof(uint32_t)) {
+		return -1;
+	}
+	*drops = meminfo[SK_MEMINFO_DROPS];
+	return 0;
+}
+
+/**
+ * Send a file descriptor with a message.
+ *
+ * @param	sock	Unix domain socket.
+ * @param	fd	File descriptor to pass.
+ * @param	data	Message bytes (at least one).
+ * @param	n	Number of message bytes.
+ * @param	flags	Flags for sendmsg (e.g. MSG_DONTWAIT).
+ * @return	-1 on error and 0 on success.
+ **/
+int socket_send_fd(int sock, int fd, const void *data, size_t n, int flags) {
+	char control[CMSG_SPACE(sizeof(int))] = {0};
+	struct iovec iov = {(void *)data, n};
+	struct msghdr msg = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= control,
+		.msg_controllen	= sizeof(control),
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	return sendmsg(sock, &msg, flags | MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/**
+ * Receive a file descriptor with a message.
+ *
+ * @param	sock	Unix domain socket.
+ * @param	data	Buffer for message bytes.
+ * @param	n	Size of buffer (set to number of bytes received).
+ * @param	flags	Flags for recvmsg (e.g. MSG_DONTWAIT).
+ * @return	Received file descriptor or -1 on error.
+ **/
+int socket_recv_fd(int sock, void *data, size_t *n, int flags) {
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {data, *n};
+	struct msghdr msg = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= control,
+		.msg_controllen	= sizeof(control),
+	};
+
+	ssize_t nread = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+	if (nread <= 0) {
+		return -1;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	*n = nread;
+	return fd;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
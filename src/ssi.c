@@ -0,0 +1,311 @@
+/* ssi.c: Server-Side Includes */
+
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define SSI_SLOTS	64
+#define SSI_DEPTH	4			/* Maximum include nesting */
+#define SSI_SEGMENTS	1024			/* Maximum fragments per response */
+#define SSI_DIRECTIVE	"<!--#include "
+#define SSI_ERROR	"[an error occurred while processing this directive]"
+
+typedef struct SsiPage SsiPage;
+
+/**
+ * Compiled fragment of a page: either a static byte range of the page or a
+ * reference to an included document.
+ */
+typedef struct {
+	size_t	offset;			/*< Offset of static bytes in page data */
+	size_t	length;			/*< Length of static bytes */
+	char	*include;		/*< Real path of included document or NULL */
+} SsiFragment;
+
+/**
+ * Cached document and its compiled fragment list.
+ *
+ * Documents are never evicted, only recompiled in place when their mtime or
+ * size changes, so the body segments of a response can point straight into them.
+ */
+struct SsiPage {
+	char		*path;		/*< Real path of document */
+	struct timespec	mtime;		/*< Document mtime when compiled */
+	off_t		size;		/*< Document size when compiled */
+	unsigned long	stamp;		/*< Response that last validated the page */
+	char		*data;		/*< Document contents */
+	SsiFragment	*fragments;	/*< Compiled fragments */
+	size_t		nfragments;	/*< Number of fragments */
+	SsiPage		*next;		/*< Next page in hash chain */
+};
+
+static SsiPage      *Pages[SSI_SLOTS];
+static unsigned long Stamp = 0;
+
+/**
+ * Resolve the target of an include directive.
+ *
+ * @param	page	Real path of including document.
+ * @param	attr	Directive attribute ("virtual" or "file").
+ * @param	value	Attribute value.
+ * @return	An allocated string containing the real path of the target or NULL.
+ *
+ * "virtual" values are URIs, while "file" values are relative to the
+ * including document.  Either way the target must lie under RootPath.
+ **/
+static char * ssi_resolve(const char *page, const char *attr, const char *value) {
+	char uri[BUFSIZ];
+
+	if (streq(attr, "virtual")) {
+		return determine_request_path(value);
+	}
+	if (!streq(attr, "file") || value[0] == '/') {
+		return NULL;
+	}
+
+	const char *dir = page + strlen(RootPath);
+	const char *end = strrchr(dir, '/');
+	snprintf(uri, BUFSIZ, "%.*s/%s", (int)(end ? end - dir : 0), dir, value);
+	return determine_request_path(uri);
+}
+
+/**
+ * Compile page data into fragments.
+ *
+ * @param	p	Page with data loaded.
+ * @return	-1 on error and 0 on success.
+ *
+ * Directives have the form <!--#include virtual="/uri" --> or
+ * <!--#include file="relative" -->.  Malformed directives are kept as text.
+ **/
+static int ssi_compile(SsiPage *p) {
+	size_t capacity = 0;
+	size_t offset   = 0;
+	char  *s        = p->data;
+
+	while (true) {
+		char *directive = strstr(s, SSI_DIRECTIVE);
+		char *end       = directive ? strstr(directive, "-->") : NULL;
+		char *include   = NULL;
+
+		/* Parse attr="value" */
+		if (end) {
+			char attr[16];
+			char value[PATH_MAX];
+			if (sscanf(directive + strlen(SSI_DIRECTIVE), " %15[a-z] = \"%4095[^\"]\"", attr, value) == 2) {
+				include = ssi_resolve(p->path, attr, value);
+				if (!include) {
+					log("Unable to resolve include %s=\"%s\" in %s", attr, value, p->path);
+					include = strdup("");
+				}
+			} else {
+				end = NULL;
+			}
+		}
+
+		if (p->nfragments + 2 > capacity) {
+			capacity = capacity ? 2 * capacity : 8;
+			SsiFragment *fragments = realloc(p->fragments, capacity * sizeof(SsiFragment));
+			if (!fragments) {
+				log("Unable to realloc: %s", strerror(errno));
+				free(include);
+				return -1;
+			}
+			p->fragments = fragments;
+		}
+
+		/* Static bytes up to the directive (or the end of the page) */
+		size_t stop = end ? directive - p->data : (size_t)p->size;
+		if (stop > offset) {
+			p->fragments[p->nfragments++] = (SsiFragment){offset, stop - offset, NULL};
+		}
+		if (!end) {
+			break;
+		}
+
+		p->fragments[p->nfragments++] = (SsiFragment){0, 0, include};
+		offset = end + 3 - p->data;
+		s      = end + 3;
+	}
+	return 0;
+}
+
+/**
+ * Release page data and fragments.
+ *
+ * @param	p	Page.
+ **/
+static void ssi_release(SsiPage *p) {
+	for (size_t i = 0; i < p->nfragments; i++) {
+		free(p->fragments[i].include);
+	}
+	free(p->fragments);
+	free(p->data);
+	p->fragments  = NULL;
+	p->nfragments = 0;
+	p->data       = NULL;
+}
+
+/**
+ * Lookup compiled page, (re)compiling it if it changed.
+ *
+ * @param	path	Real path of document.
+ * @return	Compiled page or NULL on error.
+ *
+ * A page is validated with stat once per response, so a page included
+ * several times is never recompiled while its fragments are in use.
+ * Executable documents are CGI scripts, and including them would disclose
+ * their source, so they are refused.
+ **/
+static SsiPage * ssi_lookup(const char *path) {
+	size_t slot = hash_bytes(path, strlen(path), HASH_INIT) % SSI_SLOTS;
+	SsiPage *p  = Pages[slot];
+	while (p && !streq(p->path, path)) {
+		p = p->next;
+	}
+
+	if (p && p->stamp == Stamp) {
+		return p->data ? p : NULL;
+	}
+
+	struct stat sb;
+	if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+		log("Unable to stat %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	if (access(path, X_OK) == 0) {
+		log("Refusing to include script %s", path);
+		return NULL;
+	}
+
+	if (!p) {
+		p = calloc(1, sizeof(SsiPage));
+		if (!p || !(p->path = strdup(path))) {
+			log("Unable to calloc: %s", strerror(errno));
+			free(p);
+			return NULL;
+		}
+		p->next     = Pages[slot];
+		Pages[slot] = p;
+	}
+	p->stamp = Stamp;
+
+	if (p->data && p->mtime.tv_sec == sb.st_mtim.tv_sec &&
+	    p->mtime.tv_nsec == sb.st_mtim.tv_nsec && p->size == sb.st_size) {
+		return p;
+	}
+
+	/* Load and compile document */
+	debug("Compiling %s", path);
+	ssi_release(p);
+	p->mtime = sb.st_mtim;
+	p->size  = sb.st_size;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log("Unable to open: %s", strerror(errno));
+		return NULL;
+	}
+	p->data = malloc(sb.st_size + 1);
+	ssize_t nread = p->data ? read(fd, p->data, sb.st_size) : -1;
+	close(fd);
+	if (nread != sb.st_size) {
+		log("Unable to read %s", path);
+		ssi_release(p);
+		return NULL;
+	}
+	p->data[sb.st_size] = 0;
+
+	if (ssi_compile(p) < 0) {
+		ssi_release(p);
+		return NULL;
+	}
+	return p;
+}
+
+/**
+ * Gather the fragments of a page into a body.
+ *
+ * @param	p	Compiled page.
+ * @param	body	Body to append fragments to.
+ * @param	n	Number of fragments appended so far.
+ * @param	depth	Current include depth.
+ * @return	Number of fragments appended afterwards or -1 if there are too
+ * many (or appending fails).
+ **/
+static int ssi_gather(SsiPage *p, Body *body, int n, int depth) {
+	for (size_t i = 0; i < p->nfragments; i++) {
+		SsiFragment *f = &p->fragments[i];
+		if (n == SSI_SEGMENTS) {
+			return -1;
+		}
+
+		if (!f->include) {
+			if (body_memory(body, p->data + f->offset, f->length, NULL) < 0) {
+				return -1;
+			}
+			n++;
+			continue;
+		}
+
+		SsiPage *included = (f->include[0] && depth < SSI_DEPTH) ? ssi_lookup(f->include) : NULL;
+		if (included) {
+			if ((n = ssi_gather(included, body, n, depth + 1)) < 0) {
+				return -1;
+			}
+		} else {
+			if (body_memory(body, SSI_ERROR, strlen(SSI_ERROR), NULL) < 0) {
+				return -1;
+			}
+			n++;
+		}
+	}
+	return n;
+}
+
+/**
+ * Handle server-side include request.
+ *
+ * @param	r	HTTP Request structure.
+ * @return	Status of the HTTP SSI request.
+ *
+ * The page and its includes are each parsed once into a list of static byte
+ * ranges and include references, cached, and recompiled only when their mtime
+ * changes.  The response body is then a chain of slices of the cached pages,
+ * written with a single writev.  The cache belongs to the process, so it
+ * only pays off when a process serves many requests (not in forking mode).
+ **/
+Status handle_ssi_request(Request *r) {
+	Body body = {0};
+
+	Stamp++;
+	SsiPage *p = ssi_lookup(r->path);
+	if (!p) {
+		return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+	}
+
+	if (ssi_gather(p, &body, 0, 0) < 0) {
+		log("Too many fragments in %s", r->path);
+		body_free(&body);
+		return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+	}
+
+	char *mimetype = determine_mimetype(r->path);
+	fprintf(r->file, "HTTP/1.0 %s\r\n", http_status_string(HTTP_STATUS_OK));
+	fprintf(r->file, "Content-type: %s\r\n", mimetype);
+	write_connection_headers(r, body_length(&body));
+	fputs("\r\n", r->file);
+	free(mimetype);
+
+	body_write(r, &body);
+	return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -46,6 +47,12 @@ char * determine_mimetype(const char *path) {
 	}
 	debug("Extension: %s", ext);
 
+	/* Use the table built at startup when there is one */
+	const char *warm = warm_mimetype(ext + 1);
+	if (warm) {
+		return strdup(warm);
+	}
+
 	/* Open MimeTypesPath file */
 	fs = fopen(MimeTypesPath, "r");
 	if (!fs) {
@@ -120,27 +127,35 @@ char * determine_request_path(const char *uri) {
 const char * http_status_string(Status status) {
 	static char *StatusStrings[] = {
 		"200 OK",
+		"304 Not Modified",
 		"400 Bad Request",
 		"404 Not Found",
 		"500 Internal Server Error",
+		"503 Service Unavailable",
 		"418 I'm A Teapot"
 	};
 
 	if (status == HTTP_STATUS_OK) {
 		return StatusStrings[0];
 	}
-	else if (status == HTTP_STATUS_BAD_REQUEST) {
+	else if (status == HTTP_STATUS_NOT_MODIFIED) {
 		return StatusStrings[1];
 	}
-	else if (status == HTTP_STATUS_NOT_FOUND) {
+	else if (status == HTTP_STATUS_BAD_REQUEST) {
 		return StatusStrings[2];
 	}
-	else if (status == HTTP_STATUS_INTERNAL_SERVER_ERROR) {
+	else if (status == HTTP_STATUS_NOT_FOUND) {
 		return StatusStrings[3];
 	}
-	else {
+	else if (status == HTTP_STATUS_INTERNAL_SERVER_ERROR) {
 		return StatusStrings[4];
 	}
+	else if (status == HTTP_STATUS_SERVICE_UNAVAILABLE) {
+		return StatusStrings[5];
+	}
+	else {
+		return StatusStrings[6];
+	}
 }
 
 /**
@@ -169,5 +184,64 @@ char * skip_whitespace(char *s) {
 	return s;
 }
 
+/**
+ * Measure CPU utilisation since the last sample.
+ *
+ * @param	last	Previous sample (updated to the current one).
+ * @return	Fraction of CPU time spent busy across all CPUs since the last
+ * sample, or 0 if it cannot be determined (or there was no last sample).
+ **/
+double cpu_utilisation(CpuSample *last) {
+	unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+	FILE *fs = fopen("/proc/stat", "r");
+	if (!fs) {
+		return 0;
+	}
+	int n = fscanf(fs, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		&user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
+	fclose(fs);
+	if (n != 8) {
+		return 0;
+	}
+
+	CpuSample now = {
+		.busy	= user + nice + system + irq + softirq + steal,
+		.total	= user + nice + system + idle + iowait + irq + softirq + steal,
+	};
+	double busy = last->total && now.total > last->total ?
+		(double)(now.busy - last->busy) / (now.total - last->total) : 0;
+	*last = now;
+	return busy;
+}
+
+/**
+ * Hash bytes with 64-bit FNV-1a.
+ *
+ * @param	data	Bytes to hash.
+ * @param	n	Number of bytes.
+ * @param	hash	HASH_INIT or the result of hashing the preceding bytes.
+ * @return	Hash of all bytes so far.
+ *
+ * Passing the previous result back in allows data to be hashed as it streams.
+ **/
+uint64_t hash_bytes(const void *data, size_t n, uint64_t hash) {
+	const unsigned char *p = data;
+	while (n--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3UL;
+	}
+	return hash;
+}
+
+/**
+ * Read the monotonic clock.
+ *
+ * @return	Milliseconds since an arbitrary fixed point.
+ **/
+long monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c */
@@ -0,0 +1,424 @@
+/* warm.c: Read-Only Caches Built Before Forking */
+
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define WARM_MAX_TOTAL	(16 << 20)	/* Bytes of documents to preload */
+#define WARM_MAX_FILES	4096		/* Documents to preload */
+#define WARM_CANDIDATES	(4 * WARM_MAX_FILES)	/* Documents considered for preloading */
+#define WARM_FDS	16		/* Descriptors nftw may hold open */
+#define NSTATUSES	(HTTP_STATUS_SERVICE_UNAVAILABLE + 1)
+
+/**
+ * Extension to MIME type mapping
+ */
+typedef struct {
+	const char	*ext;		/*< File extension (without the dot) */
+	const char	*type;		/*< MIME type */
+	size_t		order;		/*< Line of the rule (first rule wins) */
+} WarmMime;
+
+/**
+ * Preloaded document
+ */
+typedef struct {
+	const char	*path;		/*< Real path of document */
+	struct timespec	mtime;		/*< Document mtime when loaded */
+	off_t		size;		/*< Document size when loaded */
+	unsigned int	hits;		/*< Popularity in the restored hot set */
+	const char	*data;		/*< Document contents */
+} WarmFile;
+
+/**
+ * Prebuilt error response body
+ */
+typedef struct {
+	const char	*body;		/*< HTML body or NULL */
+	size_t		length;		/*< Length of body */
+} WarmError;
+
+/* Everything below points into Arena and is never written after warm_init */
+
+static char      *Arena      = NULL;
+static size_t     ArenaSize  = 0;
+static WarmMime  *Mimes      = NULL;
+static size_t     NMimes     = 0;
+static WarmFile  *Files      = NULL;
+static size_t     NFiles     = 0;
+static WarmError  Errors[NSTATUSES];
+
+/* Scratch state used only while building */
+
+static WarmFile  *Pending    = NULL;
+static size_t     NPending   = 0;
+
+/**
+ * Compare MIME mappings by extension, then rule order.
+ **/
+static int warm_mime_compare(const void *a, const void *b) {
+	const WarmMime *x = a;
+	const WarmMime *y = b;
+	int c = strcmp(x->ext, y->ext);
+	return c ? c : (x->order > y->order) - (x->order < y->order);
+}
+
+/**
+ * Compare documents by path.
+ **/
+static int warm_file_compare(const void *a, const void *b) {
+	return strcmp(((const WarmFile *)a)->path, ((const WarmFile *)b)->path);
+}
+
+/**
+ * Compare documents by popularity (most popular first).
+ **/
+static int warm_hits_compare(const void *a, const void *b) {
+	const WarmFile *x = a;
+	const WarmFile *y = b;
+	return (x->hits < y->hits) - (x->hits > y->hits);
+}
+
+/**
+ * Reserve bytes in the arena.
+ *
+ * @param	offset	Current fill offset (advanced past the reservation).
+ * @param	n	Number of bytes.
+ * @return	Pointer to the reserved bytes.
+ **/
+static char * warm_reserve(size_t *offset, size_t n) {
+	char *p = Arena + *offset;
+	*offset += (n + 7) & ~(size_t)7;
+	return p;
+}
+
+/**
+ * Copy a string into the arena.
+ **/
+static const char * warm_strdup(size_t *offset, const char *s) {
+	size_t n = strlen(s) + 1;
+	return memcpy(warm_reserve(offset, n), s, n);
+}
+
+/**
+ * Read the MIME types file into temporary mappings.
+ *
+ * @param	mimes	Set to allocated array of mappings (strings allocated too).
+ * @return	Number of mappings.
+ **/
+static size_t warm_read_mimes(WarmMime **mimes) {
+	char buffer[BUFSIZ];
+	size_t n = 0;
+	size_t capacity = 0;
+	size_t order = 0;
+
+	*mimes = NULL;
+	FILE *fs = fopen(MimeTypesPath, "r");
+	if (!fs) {
+		log("Unable to fopen MimeTypesPath: %s", strerror(errno));
+		return 0;
+	}
+	while (fgets(buffer, BUFSIZ, fs)) {
+		char *type = strtok(buffer, WHITESPACE);
+		char *ext;
+		if (!type || type[0] == '#') {
+			continue;
+		}
+		while ((ext = strtok(NULL, WHITESPACE))) {
+			if (n == capacity) {
+				capacity = capacity ? 2 * capacity : 256;
+				WarmMime *grown = realloc(*mimes, capacity * sizeof(WarmMime));
+				if (!grown) {
+					break;
+				}
+				*mimes = grown;
+			}
+			(*mimes)[n++] = (WarmMime){strdup(ext), strdup(type), order++};
+		}
+	}
+	fclose(fs);
+	return n;
+}
+
+/**
+ * Visit one entry of the document tree.
+ *
+ * Directories have their index decision resolved (that cache is only written
+ * on a miss, so warming it now keeps it clean afterwards).  Small static
+ * documents are queued for preloading; CGI scripts and SSI pages are skipped
+ * since they are never served verbatim.
+ **/
+static int warm_visit(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+	if (type == FTW_D) {
+		free(determine_index_path(path, sb));
+		return FTW_CONTINUE;
+	}
+
+	const char *ext = strrchr(path, '.');
+	if (type != FTW_F || sb->st_size > CACHE_MAX_FILE || access(path, X_OK) == 0 ||
+	    (ext && streq(ext, SSI_EXTENSION)) || !cluster_local(path)) {
+		return FTW_CONTINUE;
+	}
+	if (NPending == WARM_CANDIDATES) {
+		return FTW_STOP;
+	}
+
+	WarmFile *pending = realloc(Pending, (NPending + 1) * sizeof(WarmFile));
+	if (!pending) {
+		return FTW_STOP;
+	}
+	Pending = pending;
+	Pending[NPending++] = (WarmFile){strdup(path), sb->st_mtim, sb->st_size, snapshot_hits(path), NULL};
+	return FTW_CONTINUE;
+}
+
+/**
+ * Read a document into the arena.
+ *
+ * @return	true if the whole document was read.
+ **/
+static bool warm_read_file(const char *path, char *data, off_t size) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	off_t nread = 0;
+	while (nread < size) {
+		ssize_t n = read(fd, data + nread, size - nread);
+		if (n <= 0) {
+			break;
+		}
+		nread += n;
+	}
+	close(fd);
+	return nread == size;
+}
+
+/**
+ * Render the body of an error response.
+ *
+ * @param	status	HTTP status.
+ * @param	length	Set to length of body.
+ * @return	Allocated body or NULL.
+ *
+ * This mirrors handle_error: 404 uses www/html/404.html when it exists and
+ * everything else a minimal HTML description.
+ **/
+static char * warm_render_error(Status status, size_t *length) {
+	char  *body = NULL;
+	FILE  *fs   = open_memstream(&body, length);
+	if (!fs) {
+		return NULL;
+	}
+
+	FILE *page = status == HTTP_STATUS_NOT_FOUND ? fopen("www/html/404.html", "r") : NULL;
+	if (page) {
+		char buffer[BUFSIZ];
+		size_t nread;
+		while ((nread = fread(buffer, 1, BUFSIZ, page)) > 0) {
+			fwrite(buffer, 1, nread, fs);
+		}
+		fclose(page);
+	} else {
+		fprintf(fs,
+			"<!DOCTYPE html>\n"
+			"<html>\n"
+			"  <body><h1>%s</h1></body>\n"
+			"</html>\n", http_status_string(status));
+	}
+	fclose(fs);
+	return body;
+}
+
+/**
+ * Build the read-only caches.
+ *
+ * @return	-1 on error and 0 on success.
+ *
+ * This runs once before any worker is forked.  The MIME table, the small
+ * documents under RootPath (the most popular ones first when a hot set was
+ * restored, and only those this instance owns within a cache cluster), and
+ * the error response bodies are laid out in a single mapping that is then made read-only: lookups are binary searches
+ * with no hit counters, reference counts, or LRU links, so no worker ever
+ * writes to these pages and all of them share one physical copy.  The
+ * directory index cache is warmed at the same time.
+ *
+ * Documents that change after startup simply stop matching (their mtime or
+ * size differs) and fall back to the regular per-worker cache.
+ **/
+int warm_init(void) {
+	WarmMime *mimes = NULL;
+	size_t nmimes   = warm_read_mimes(&mimes);
+
+	if (RootPath && nftw(RootPath, warm_visit, WARM_FDS, FTW_PHYS | FTW_ACTIONRETVAL) < 0) {
+		log("Unable to nftw %s: %s", RootPath, strerror(errno));
+	}
+
+	/* Keep the most popular documents (per the restored hot set) within budget */
+	qsort(Pending, NPending, sizeof(WarmFile), warm_hits_compare);
+	size_t kept  = 0;
+	size_t bytes = 0;
+	for (size_t i = 0; i < NPending; i++) {
+		if (kept < WARM_MAX_FILES && bytes + Pending[i].size <= WARM_MAX_TOTAL) {
+			bytes += Pending[i].size;
+			Pending[kept++] = Pending[i];
+		} else {
+			free((char *)Pending[i].path);
+		}
+	}
+	NPending = kept;
+
+	char  *bodies[NSTATUSES] = {NULL};
+	size_t lengths[NSTATUSES] = {0};
+	for (Status s = HTTP_STATUS_BAD_REQUEST; s < NSTATUSES; s++) {
+		bodies[s] = warm_render_error(s, &lengths[s]);
+	}
+
+	/* Size the arena: arrays, strings, documents, and bodies (8-byte aligned) */
+	size_t size = (nmimes * sizeof(WarmMime) + 7) + (NPending * sizeof(WarmFile) + 7);
+	for (size_t i = 0; i < nmimes; i++) {
+		size += strlen(mimes[i].ext) + strlen(mimes[i].type) + 2 + 14;
+	}
+	for (size_t i = 0; i < NPending; i++) {
+		size += strlen(Pending[i].path) + 1 + Pending[i].size + 14;
+	}
+	for (Status s = 0; s < NSTATUSES; s++) {
+		size += lengths[s] + 7;
+	}
+
+	int status = 0;
+	Arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (Arena == MAP_FAILED) {
+		log("Unable to mmap: %s", strerror(errno));
+		Arena  = NULL;
+		status = -1;
+		goto cleanup;
+	}
+	ArenaSize = size;
+
+	/* MIME table, deduplicated so the first rule for an extension wins */
+	size_t offset = 0;
+	qsort(mimes, nmimes, sizeof(WarmMime), warm_mime_compare);
+	Mimes = (WarmMime *)warm_reserve(&offset, nmimes * sizeof(WarmMime));
+	for (size_t i = 0; i < nmimes; i++) {
+		if (NMimes && streq(Mimes[NMimes - 1].ext, mimes[i].ext)) {
+			continue;
+		}
+		Mimes[NMimes++] = (WarmMime){
+			warm_strdup(&offset, mimes[i].ext), warm_strdup(&offset, mimes[i].type), mimes[i].order
+		};
+	}
+
+	/* Documents, sorted by path */
+	qsort(Pending, NPending, sizeof(WarmFile), warm_file_compare);
+	Files = (WarmFile *)warm_reserve(&offset, NPending * sizeof(WarmFile));
+	for (size_t i = 0; i < NPending; i++) {
+		char *data = warm_reserve(&offset, Pending[i].size);
+		if (warm_read_file(Pending[i].path, data, Pending[i].size)) {
+			Files[NFiles] = Pending[i];
+			Files[NFiles].path = warm_strdup(&offset, Pending[i].path);
+			Files[NFiles].data = data;
+			NFiles++;
+		}
+	}
+
+	/* Error bodies */
+	for (Status s = 0; s < NSTATUSES; s++) {
+		if (bodies[s]) {
+			Errors[s].body   = memcpy(warm_reserve(&offset, lengths[s]), bodies[s], lengths[s]);
+			Errors[s].length = lengths[s];
+		}
+	}
+
+	if (mprotect(Arena, ArenaSize, PROT_READ) < 0) {
+		log("Unable to mprotect: %s", strerror(errno));
+	}
+	log("Warmed %zu MIME types and %zu documents (%zu bytes)", NMimes, NFiles, ArenaSize);
+
+cleanup:
+	for (size_t i = 0; i < nmimes; i++) {
+		free((char *)mimes[i].ext);
+		free((char *)mimes[i].type);
+	}
+	free(mimes);
+	for (size_t i = 0; i < NPending; i++) {
+		free((char *)Pending[i].path);
+	}
+	free(Pending);
+	Pending  = NULL;
+	NPending = 0;
+	for (Status s = 0; s < NSTATUSES; s++) {
+		free(bodies[s]);
+	}
+	return status;
+}
+
+/**
+ * Lookup MIME type of an extension.
+ *
+ * @param	ext	File extension (without the dot).
+ * @return	MIME type, DefaultMimeType if the extension is unknown, or NULL
+ * if the table was not built.
+ **/
+const char * warm_mimetype(const char *ext) {
+	if (!Mimes) {
+		return NULL;
+	}
+	size_t lo = 0;
+	size_t hi = NMimes;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		int c = strcmp(Mimes[mid].ext, ext);
+		if (c == 0) {
+			return Mimes[mid].type;
+		}
+		if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return DefaultMimeType;
+}
+
+/**
+ * Lookup preloaded document.
+ *
+ * @param	path	Real path of document.
+ * @param	sb	Current stat information of document.
+ * @return	Document contents or NULL if not preloaded (or since changed).
+ **/
+const char * warm_file(const char *path, const struct stat *sb) {
+	WarmFile key = {.path = path};
+	WarmFile *f  = NFiles ? bsearch(&key, Files, NFiles, sizeof(WarmFile), warm_file_compare) : NULL;
+	if (!f || f->size != sb->st_size ||
+	    f->mtime.tv_sec != sb->st_mtim.tv_sec || f->mtime.tv_nsec != sb->st_mtim.tv_nsec) {
+		return NULL;
+	}
+	return f->data;
+}
+
+/**
+ * Lookup prebuilt error body.
+ *
+ * @param	status	HTTP status.
+ * @param	length	Set to length of body.
+ * @return	Body or NULL if none was built.
+ **/
+const char * warm_error(Status status, size_t *length) {
+	if (status >= NSTATUSES || !Errors[status].body) {
+		return NULL;
+	}
+	*length = Errors[status].length;
+	return Errors[status].body;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,170 @@
+/* watchdog.c: Event-Loop Stall Watchdog */
+
+#include "main.h"
+
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define WATCHDOG_FRAMES		32		/* Deepest stack captured */
+#define WATCHDOG_DETAIL		128		/* Longest request line recorded */
+#define WATCHDOG_CAPTURE	100		/* Milliseconds to wait for a stack */
+
+/* Global Variables */
+
+int StallThreshold = 20;
+
+static pthread_t     Loop;				/* Thread running the event loop */
+static long          Busy      = 0;			/* Start of current iteration (0 while waiting) */
+static unsigned long Iteration = 0;			/* Iterations started */
+static const char   *Phase     = NULL;			/* What the iteration is doing */
+static int           PhaseFd   = -1;			/* Connection it is doing it for */
+static char          Detail[WATCHDOG_DETAIL];		/* Request line it is doing it for */
+static void         *Frames[WATCHDOG_FRAMES];		/* Stack captured by the loop thread */
+static int           NFrames   = 0;			/* Frames captured (-1 while pending) */
+
+/**
+ * Capture the stack of the loop thread (SIGUSR2 handler).
+ *
+ * @param	signum	Signal number.
+ *
+ * Only records the frames; symbolising them is left to the watchdog thread.
+ **/
+static void watchdog_signal(int signum) {
+	int saved = errno;
+	__atomic_store_n(&NFrames, backtrace(Frames, WATCHDOG_FRAMES), __ATOMIC_RELEASE);
+	errno = saved;
+}
+
+/**
+ * Report a stalled iteration with the loop thread's stack.
+ *
+ * @param	elapsed	Milliseconds the iteration has been running.
+ **/
+static void watchdog_report(long elapsed) {
+	char detail[WATCHDOG_DETAIL];
+	const char *phase = __atomic_load_n(&Phase, __ATOMIC_ACQUIRE);
+	int fd = __atomic_load_n(&PhaseFd, __ATOMIC_RELAXED);
+	memcpy(detail, Detail, sizeof(detail));
+	detail[sizeof(detail) - 1] = 0;
+
+	__atomic_store_n(&NFrames, -1, __ATOMIC_RELEASE);
+	pthread_kill(Loop, SIGUSR2);
+
+	int frames = -1;
+	for (long waited = 0; waited < WATCHDOG_CAPTURE && frames < 0; waited++) {
+		nanosleep(&(struct timespec){0, 1000000}, NULL);
+		frames = __atomic_load_n(&NFrames, __ATOMIC_ACQUIRE);
+	}
+
+	__atomic_add_fetch(&Stats->stalls, 1, __ATOMIC_RELAXED);
+	log("STALL in %s for %ldms (fd %d: %s)", phase ? phase : "unknown", elapsed, fd, detail[0] ? detail : "-");
+	if (frames > 0) {
+		backtrace_symbols_fd(Frames, frames, STDERR_FILENO);
+	}
+}
+
+/**
+ * Watch the heartbeat of the event loop.
+ *
+ * @param	arg	Unused.
+ * @return	Never returns.
+ *
+ * Checks twice per StallThreshold and reports each stalled iteration once.
+ **/
+static void * watchdog_run(void *arg) {
+	long interval = StallThreshold > 1 ? StallThreshold / 2 : 1;
+	struct timespec pause = {interval / 1000, (interval % 1000) * 1000000L};
+	unsigned long reported = 0;
+
+	while (true) {
+		nanosleep(&pause, NULL);
+
+		unsigned long iteration = __atomic_load_n(&Iteration, __ATOMIC_ACQUIRE);
+		long started = __atomic_load_n(&Busy, __ATOMIC_ACQUIRE);
+		long elapsed = monotonic_ms() - started;
+		if (started && iteration != reported && elapsed >= StallThreshold) {
+			reported = iteration;
+			watchdog_report(elapsed);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Start watching the event loop running on the calling thread.
+ *
+ * @return	-1 on error and 0 on success (or if disabled).
+ *
+ * An iteration that runs for StallThreshold milliseconds or more means
+ * something blocked the loop (a stat, a scandir, a slow write), and every
+ * connection waited for it.  The watchdog thread then interrupts the loop
+ * with SIGUSR2 to capture its stack, and logs it with the phase, connection,
+ * and request line the iteration was working on.
+ **/
+int watchdog_start(void) {
+	if (StallThreshold <= 0) {
+		return 0;
+	}
+
+	/* backtrace loads libgcc on first use, which must not happen in the handler */
+	backtrace(Frames, WATCHDOG_FRAMES);
+
+	struct sigaction sa = {.sa_handler = watchdog_signal, .sa_flags = SA_RESTART};
+	sigaction(SIGUSR2, &sa, NULL);
+
+	Loop = pthread_self();
+	pthread_t thread;
+	int status = pthread_create(&thread, NULL, watchdog_run, NULL);
+	if (status != 0) {
+		log("Unable to pthread_create: %s", strerror(status));
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/**
+ * Mark the start of an event loop iteration.
+ **/
+void watchdog_busy(void) {
+	__atomic_add_fetch(&Iteration, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&Busy, monotonic_ms(), __ATOMIC_RELEASE);
+}
+
+/**
+ * Record what the current iteration is doing.
+ *
+ * @param	phase	Static description of the work.
+ * @param	fd	Connection being worked on or -1.
+ * @param	head	Request head being worked on or NULL.
+ * @param	length	Bytes of request head.
+ *
+ * Only the request line of the head is kept.
+ **/
+void watchdog_phase(const char *phase, int fd, const char *head, size_t length) {
+	size_t n = 0;
+	while (head && n < length && n < WATCHDOG_DETAIL - 1 && head[n] != '\r' && head[n] != '\n') {
+		Detail[n] = head[n];
+		n++;
+	}
+	Detail[n] = 0;
+	__atomic_store_n(&PhaseFd, fd, __ATOMIC_RELAXED);
+	__atomic_store_n(&Phase, phase, __ATOMIC_RELEASE);
+}
+
+/**
+ * Mark the end of an event loop iteration (waiting is not a stall).
+ **/
+void watchdog_idle(void) {
+	__atomic_store_n(&Busy, 0, __ATOMIC_RELEASE);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
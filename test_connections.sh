@@ -0,0 +1,77 @@
+#!/bin/bash
+# test_connections.sh: Check responses on connections that carry more than one request,
+# and that requests served by the same worker do not leak into each other
+
+PROGRAM=${PROGRAM:-./bin/main}
+MODES=${*:-forking preforked dispatch}
+FAILURES=0
+
+# Send raw bytes on one connection and print what comes back
+# usage: fetch port request
+fetch() {
+    exec 3<>/dev/tcp/127.0.0.1/$1 || return 1
+    printf "$2" >&3
+    timeout 5 cat <&3
+    exec 3<&-
+}
+
+# Send raw bytes on one connection and count the responses that come back
+# usage: responses port request
+responses() {
+    fetch $1 "$2" | grep -ac '^HTTP/1\.[01] '
+}
+
+# usage: check mode port description expected request
+check() {
+    local got=$(responses $2 "$5")
+    if [ "$got" = "$4" ]; then
+        echo "  $3: ok"
+    else
+        echo "  $3: expected $4 responses, got ${got:-0}"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+# Run a CGI script with a header and then without it
+# usage: check_environment port
+check_environment() {
+    fetch $1 'GET /scripts/env.sh HTTP/1.0\r\nUser-Agent: leaked-agent\r\n\r\n' > /dev/null
+    local output=$(fetch $1 'GET /scripts/env.sh HTTP/1.0\r\n\r\n')
+    if ! echo "$output" | grep -q '^REQUEST_URI='; then
+        echo "  CGI environment: script did not run"
+        FAILURES=$((FAILURES + 1))
+    elif echo "$output" | grep -q 'leaked-agent'; then
+        echo "  CGI environment: header leaked into the next request"
+        FAILURES=$((FAILURES + 1))
+    else
+        echo "  CGI environment: ok"
+    fi
+}
+
+for mode in $MODES; do
+    # A single (CGI) worker, so both scripts are started by the same process
+    case $mode in
+        preforked)  args="-w 1:1" ;;
+        dispatch)   args="-D 1:1:1:1" ;;
+        *)          args="" ;;
+    esac
+
+    port=$((9000 + RANDOM % 20000))
+    $PROGRAM -c $mode -p $port $args 2> test_connections.log &
+    pid=$!
+    sleep 0.5
+
+    echo "$mode:"
+    check $mode $port "pipelined requests" 2 \
+        'GET /html/ HTTP/1.1\r\nHost: localhost\r\n\r\nGET /CSS/style.css HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n'
+    check $mode $port "request with a body" 1 \
+        'GET /html/ HTTP/1.1\r\nHost: localhost\r\nContent-Length: 5\r\n\r\nhello'
+    check_environment $port
+
+    kill $pid
+    wait $pid 2> /dev/null
+done
+
+exit $FAILURES
+
+# vim: set expandtab sts=4 sw=4 ts=8 ft=sh: